@@ -1,15 +1,26 @@
 #pragma once
 
-#include <unordered_map>
 #include <unordered_set>
+#include <atomic>
+#include <limits>
 #include <string>
+#include <string_view>
 #include <cctype>
+#include <cstring>
 #include <memory>
-#include <set>
+#include <vector>
 #include <utility>
+#include <cstdint>
+#include <type_traits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <cstdio>
 #include <fmt/base.h>
 #include <fmt/core.h>
-#include <fmt/os.h>
+#include <fmt/format.h>
 
 #ifdef _MSC_VER
 #pragma warning (disable : 4996)
@@ -21,6 +32,14 @@ namespace utils {
 std::string format(const char *fmt, ...);
 std::string now();
 bool validate_date(const std::string&);
+// Lowercase and validate *size* `VCDValues` chars of *src* into *dst* right-aligned
+// to *width* chars, filled with leading `VCDValues::ZERO`. Return *false* if any
+// char is invalid. It runs SSE2/AVX2 kernel if CPU supports it
+bool vector_digits(char *dst, const char *src, size_t size, size_t width);
+//! name of the instruction set of `vector_digits()` kernel
+const char* vector_digits_isa();
+// Write decimal digits of *value*, return the end of written chars
+char* write_decimal(char *out, uint64_t value);
 }
 
 // -----------------------------
@@ -70,8 +89,6 @@ public:
 // -----------------------------
 struct VCDScope;
 using ScopePtr = std::shared_ptr<VCDScope>;
-struct ScopePtrHash
-{ bool operator()(const ScopePtr &l, const ScopePtr &r) const; };
 
 // -----------------------------
 class VCDVariable;
@@ -81,10 +98,591 @@ struct VarPtrHash
 struct VarPtrEqual
 { bool operator()(const VarPtr &a, const VarPtr &b) const; };
 
+// -----------------------------
+// Counters of the output, `stall` is time the writer waited for a free buffer
+struct VCDOutputStats
+{
+    uint64_t writes{};        // number of chunks written
+    uint64_t bytes{};         // number of bytes written
+    uint64_t stalls{};        // number of waits for a free buffer (async mode)
+    uint64_t stall_ns{};      // total time of the waits
+    uint64_t max_stall_ns{};  // the longest wait
+};
+
+// -----------------------------
+// Destination of VCD output, it takes the output buffer by large chunks.
+// The chunks come from one thread at a time (the background one in async mode)
+class VCDSink
+{
+public:
+    virtual ~VCDSink() = default;
+    //! write all *size* bytes of *data*, throw `VCDException` on error
+    virtual void write(const char *data, size_t size) = 0;
+    //! wait for the data taken so far to be written (e.g. the requests in flight)
+    virtual void flush() {}
+    //! all the data has been written (by `VCDWriter::close()`)
+    virtual void close() {}
+
+    // Zero-copy sinks (e.g. `VCDMmapSink`) lend their memory to encode into,
+    // instead of taking the chunks by `write()`
+    [[nodiscard]] virtual bool lends_buffer() const
+    { return false; }
+    //! lend a buffer of at least *size* bytes at the write head (it replaces an uncommitted one)
+    virtual char* acquire(size_t)
+    { throw VCDException{ "The sink does not lend a buffer" }; }
+    //! the first *size* bytes of the lent buffer are written
+    virtual void commit(size_t) {}
+};
+
+using SinkPtr = std::shared_ptr<VCDSink>;
+
+// -----------------------------
+// File descriptor by `write(2)`, e.g. a pipe to a compressor
+class VCDFdSink : public VCDSink
+{
+public:
+    //! create (truncate) the file and own its descriptor
+    explicit VCDFdSink(const std::string &filename);
+    //! write into *fd*, it is closed by `close()` if *owned*
+    explicit VCDFdSink(int fd, bool owned = false);
+    VCDFdSink(const VCDFdSink&) = delete;
+    VCDFdSink& operator=(const VCDFdSink&) = delete;
+    ~VCDFdSink() override;
+
+    void write(const char *data, size_t size) override;
+    void close() override;
+
+    [[nodiscard]] int fd() const
+    { return _fd; }
+
+private:
+    int _fd = -1;
+    bool _owned{};
+};
+
+// -----------------------------
+// Linux io_uring writes of the file sink: the buffers are lent to encode into and
+// submitted with up to *depth* of them in flight, so encoding waits only if all
+// of them are. Without io_uring (or with *depth* `0`) they are written by `write(2)`,
+// a write that io_uring does not take is done by `pwrite(2)` in place
+class VCDUringSink : public VCDSink
+{
+public:
+    static constexpr unsigned def_depth = 4u;
+
+    explicit VCDUringSink(std::shared_ptr<VCDFdSink> file, unsigned depth = def_depth);
+    explicit VCDUringSink(const std::string &filename, unsigned depth = def_depth);
+    VCDUringSink(const VCDUringSink&) = delete;
+    VCDUringSink& operator=(const VCDUringSink&) = delete;
+    ~VCDUringSink() override;
+
+    void write(const char *data, size_t size) override;
+    void flush() override;
+    void close() override;
+
+    [[nodiscard]] bool lends_buffer() const override
+    { return true; }
+    char* acquire(size_t size) override;
+    void commit(size_t size) override;
+
+    //! io_uring is used (not `write(2)`)
+    [[nodiscard]] bool active() const
+    { return _ring != nullptr; }
+    //! number of writes in flight at most, `0` if io_uring is not used
+    [[nodiscard]] unsigned depth() const
+    { return _ring ? static_cast<unsigned>(_buffers.size()) : 0u; }
+    //! wait for the writes and return the file sink, positioned after the data
+    std::shared_ptr<VCDFdSink> detach();
+
+private:
+    struct Buffer
+    {
+        std::unique_ptr<char[]> data;
+        size_t capacity{};
+        bool in_flight{};
+        uint64_t offset{};  // of the write in flight
+        size_t size{};
+    };
+    void _reap(bool wait);
+
+    struct Ring;  // io_uring rings, in the implementation
+    std::unique_ptr<Ring> _ring;
+    std::shared_ptr<VCDFdSink> _file;
+    std::vector<Buffer> _buffers;
+    unsigned _current{};
+    uint64_t _offset{};  // file offset of the next write
+    std::exception_ptr _error;
+};
+
+// -----------------------------
+// Memory-mapped file: the records are encoded right into the mapping (no copy
+// into the kernel). The file grows by *extent* allocated with `fallocate()` (so a
+// full disk throws, no `SIGBUS`; `ftruncate()` if the filesystem cannot), the
+// written pages are dropped from the process behind the head by `madvise()`, and
+// the file is trimmed to the exact size by `close()`. Not available on Windows
+class VCDMmapSink : public VCDSink
+{
+public:
+    static constexpr size_t def_extent = size_t(64u) << 20u; // 64 MiB
+
+    explicit VCDMmapSink(const std::string &filename, size_t extent = def_extent);
+    VCDMmapSink(const VCDMmapSink&) = delete;
+    VCDMmapSink& operator=(const VCDMmapSink&) = delete;
+    ~VCDMmapSink() override;
+
+    void write(const char *data, size_t size) override;
+    void close() override;
+
+    [[nodiscard]] bool lends_buffer() const override
+    { return true; }
+    char* acquire(size_t size) override;
+    void commit(size_t size) override;
+
+private:
+    void _remap(uint64_t end);
+    void _unmap();
+
+    int _fd = -1;
+    size_t _extent;
+    size_t _page;
+    char *_map{};            // the mapped window of the file
+    uint64_t _map_offset{};  // file offset of the window
+    size_t _map_size{};
+    uint64_t _file_size{};   // by `fallocate()` or `ftruncate()`
+    uint64_t _pos{};         // the write head
+    uint64_t _dropped{};     // pages are dropped up to it
+};
+
+// -----------------------------
+// Direct I/O (`O_DIRECT`) past the page cache: the records are encoded into an
+// aligned buffer and written by whole aligned *block*s, the unaligned tail is
+// carried over to the next write. `close()` writes the last block padded and
+// trims the file. If the file system refuses `O_DIRECT`, the page cache is used.
+// Not available on Windows
+class VCDDirectSink : public VCDSink
+{
+public:
+    static constexpr size_t def_block = size_t(4u) << 10u; // 4 KiB
+
+    explicit VCDDirectSink(const std::string &filename, size_t block = def_block);
+    VCDDirectSink(const VCDDirectSink&) = delete;
+    VCDDirectSink& operator=(const VCDDirectSink&) = delete;
+    ~VCDDirectSink() override;
+
+    void write(const char *data, size_t size) override;
+    void close() override;
+
+    [[nodiscard]] bool lends_buffer() const override
+    { return true; }
+    char* acquire(size_t size) override;
+    void commit(size_t size) override;
+
+    //! the file is opened with `O_DIRECT`
+    [[nodiscard]] bool direct() const
+    { return _direct; }
+
+private:
+    void _write_blocks(size_t size);
+
+    int _fd = -1;
+    bool _direct{};
+    size_t _block;
+    std::unique_ptr<char[]> _storage;
+    char *_buffer{};      // aligned by the block
+    size_t _capacity{};
+    size_t _tail{};       // unaligned bytes at the buffer start, not written yet
+    uint64_t _written{};  // by whole blocks
+};
+
+// -----------------------------
+// Compression by independent *block*s on a pool of worker threads: the chunks
+// are cut into the blocks, which are compressed in parallel and written into
+// the *out* sink in order, up to 2 blocks per thread in flight. `flush()`
+// compresses the partial block too
+class VCDCompressSink : public VCDSink
+{
+public:
+    static constexpr size_t def_block = size_t(1u) << 20u; // 1 MiB
+    static constexpr size_t min_block = size_t(4u) << 10u; // 4 KiB
+
+    VCDCompressSink(const VCDCompressSink&) = delete;
+    VCDCompressSink& operator=(const VCDCompressSink&) = delete;
+    ~VCDCompressSink() override;
+
+    void write(const char *data, size_t size) override;
+    void flush() override;
+    void close() override;
+
+    [[nodiscard]] unsigned threads() const
+    { return static_cast<unsigned>(_workers.size()); }
+
+protected:
+    //! *threads* `0` is by the number of CPUs
+    VCDCompressSink(SinkPtr out, size_t block, unsigned threads);
+
+    //! compress *size* bytes of *data* into *out* on the worker thread number *worker*
+    virtual void compress(unsigned worker, const char *data, size_t size, std::string &out) = 0;
+    //! the block of *size* bytes is written as *packed* bytes, in order on the writer's thread
+    virtual void written(size_t /*size*/, size_t /*packed*/) {}
+    //! the data written after the last block by `close()`, e.g. an index
+    virtual void finish(std::string& /*out*/) {}
+
+private:
+    struct Block
+    {
+        std::unique_ptr<char[]> data;
+        size_t size{};
+        std::string out;
+        bool done{};
+        std::exception_ptr error;
+    };
+    void _submit();
+    void _write_done(bool wait);
+    void _stop();
+    void _run(unsigned worker);
+
+    SinkPtr _out;
+    size_t _block;
+    std::vector<Block> _blocks;  // ring of the blocks in flight
+    uint64_t _head{};            // the oldest block not written yet
+    uint64_t _next{};            // the next block to compress
+    uint64_t _tail{};            // the block being filled
+    std::vector<std::thread> _workers;
+    std::mutex _mutex;
+    std::condition_variable _work_cv;
+    std::condition_variable _done_cv;
+    bool _stopped{};
+    bool _closed{};
+};
+
+// -----------------------------
+// Gzip output by zlib, e.g. `dump.vcd.gz`: the blocks are the concatenated gzip
+// members (as by `pigz`), read by `zcat` and GTKWave as one stream.
+// It throws if the library is built without zlib (no `VCDWRITER_ZLIB`)
+class VCDGzipSink : public VCDCompressSink
+{
+public:
+    static constexpr int def_level = 6;
+
+    explicit VCDGzipSink(SinkPtr out, int level = def_level, size_t block = def_block, unsigned threads = 0);
+    explicit VCDGzipSink(const std::string &filename, int level = def_level, size_t block = def_block,
+                         unsigned threads = 0);
+    ~VCDGzipSink() override;
+
+protected:
+    void compress(unsigned worker, const char *data, size_t size, std::string &out) override;
+
+private:
+    struct Stream;  // zlib stream per worker, in the implementation
+    std::unique_ptr<Stream[]> _streams;
+    int _level;
+};
+
+// -----------------------------
+// Zstandard output in the seekable format: the blocks are the independent zstd
+// frames, followed by the seek table (a skippable frame with the compressed and
+// the decompressed size of each frame), so a reader may decompress only the
+// frames of a region. It throws if the library is built without zstd
+// (no `VCDWRITER_ZSTD`)
+class VCDZstdSink : public VCDCompressSink
+{
+public:
+    static constexpr int def_level = 3;
+    static constexpr uint32_t skippable_magic = 0x184D2A5Eu;
+    static constexpr uint32_t seekable_magic = 0x8F92EAB1u;
+
+    explicit VCDZstdSink(SinkPtr out, int level = def_level, size_t block = def_block, unsigned threads = 0);
+    explicit VCDZstdSink(const std::string &filename, int level = def_level, size_t block = def_block,
+                         unsigned threads = 0);
+    ~VCDZstdSink() override;
+
+protected:
+    void compress(unsigned worker, const char *data, size_t size, std::string &out) override;
+    void written(size_t size, size_t packed) override;
+    void finish(std::string &out) override;
+
+private:
+    struct Context;  // zstd context per worker, in the implementation
+    std::unique_ptr<Context[]> _contexts;
+    int _level;
+    std::vector<std::pair<uint32_t, uint32_t>> _frames;  // compressed and decompressed sizes
+};
+
+// -----------------------------
+// C stream by `fwrite()`, it is flushed by `close()` and never closed
+class VCDStreamSink : public VCDSink
+{
+public:
+    explicit VCDStreamSink(std::FILE *stream);
+
+    void write(const char *data, size_t size) override;
+    void flush() override;
+    void close() override;
+
+private:
+    std::FILE *_stream;
+};
+
+// -----------------------------
+// Growable in-memory buffer, e.g. for tests and benchmarks
+class VCDMemorySink : public VCDSink
+{
+public:
+    void write(const char *data, size_t size) override
+    { _data.append(data, size); }
+
+    [[nodiscard]] const std::string& data() const
+    { return _data; }
+    void clear()
+    { _data.clear(); }
+
+private:
+    std::string _data;
+};
+
+// -----------------------------
+// User callback taking the chunks, e.g. to forward them into a storage layer
+class VCDCallbackSink : public VCDSink
+{
+public:
+    using Callback = std::function<void(const char *data, size_t size)>;
+
+    explicit VCDCallbackSink(Callback callback, std::function<void()> on_close = {}) :
+        _callback(std::move(callback)), _on_close(std::move(on_close))
+    {}
+
+    void write(const char *data, size_t size) override
+    { _callback(data, size); }
+    void close() override
+    {
+        if (_on_close)
+            _on_close();
+    }
+
+private:
+    Callback _callback;
+    std::function<void()> _on_close;
+};
+
+// -----------------------------
+// Output buffer of VCD file. Records are appended into the buffer and
+// it is written into the sink (the file by `write(2)` by default) by large chunks.
+// In async mode the filled buffer is written by a background thread
+// while the records are appended into the second one.
+// A sink lending its buffer is encoded into directly (it has no async mode).
+class VCDOutput
+{
+public:
+    static constexpr size_t def_buffer_size = size_t(4u) << 20u; // 4 MiB
+    static constexpr size_t min_buffer_size = size_t(4u) << 10u; // 4 KiB
+
+    explicit VCDOutput(const std::string &filename);
+    explicit VCDOutput(SinkPtr sink);
+    VCDOutput(VCDOutput&&) = delete;
+    VCDOutput(const VCDOutput&) = delete;
+    VCDOutput& operator=(const VCDOutput&) = delete;
+    VCDOutput& operator=(VCDOutput&&) = delete;
+    ~VCDOutput();
+
+    //! set size of the buffer (the buffered data is written first)
+    void set_buffer_size(size_t size);
+    //! turn on/off writing by the background thread (if the sink does not lend a buffer,
+    //! else it is on again with a sink that does not)
+    void set_async(bool async);
+    //! turn on/off io_uring writes of the file sink, return *true* if io_uring is used;
+    //! async mode is kept
+    bool set_io_uring(bool enable, unsigned depth = VCDUringSink::def_depth);
+    //! the background thread writes the buffers
+    [[nodiscard]] bool async() const
+    { return _thread.joinable(); }
+    //! the sink is written by io_uring
+    [[nodiscard]] bool io_uring() const;
+
+    [[nodiscard]] VCDOutputStats stats() const;
+    //! bytes appended since the sink was opened, the buffered ones too
+    [[nodiscard]] uint64_t bytes() const
+    { return _appended + _size; }
+
+    void put(char c)
+    {
+        if (_size == _capacity)
+            _write();
+        _data[_size++] = c;
+    }
+    void append(const char *data, size_t size)
+    {
+        if (size > _capacity - _size)
+            return _append_long(data, size);
+        std::memcpy(_data + _size, data, size);
+        _size += size;
+    }
+    void append(std::string_view str)
+    { append(str.data(), str.size()); }
+
+    //! append timestamp line `#<timestamp>`
+    void timestamp(uint64_t timestamp)
+    {
+        if (_capacity - _size < 22u) // "#" + 20 digits + "\n"
+            _write();
+        char *out = _data + _size;
+        *out++ = '#';
+        out = utils::write_decimal(out, timestamp);
+        *out++ = '\n';
+        _size = static_cast<size_t>(out - _data);
+    }
+
+    //! append formatted by `fmt` (not for the hot path)
+    template <typename... T>
+    void print(fmt::format_string<T...> fmt, T&&... args)
+    {
+        fmt::memory_buffer buf;
+        fmt::format_to(std::back_inserter(buf), fmt, std::forward<T>(args)...);
+        append(buf.data(), buf.size());
+    }
+
+    //! write the buffered data into the file, wait for the background writes
+    void flush();
+    //! flush, stop the background thread and close the sink
+    void close();
+    //! close the sink and go on with *sink* (e.g. the next file), in the same mode;
+    //! a file descriptor sink is written by io_uring if the current one is
+    void reopen(SinkPtr sink);
+    //! flush into the sink and go on with *sink*, return the previous one (not closed)
+    SinkPtr replace_sink(SinkPtr sink);
+
+private:
+    void _write();
+    void _append_long(const char *data, size_t size);
+    void _write_sink(const char *data, size_t size);
+    void _commit();
+    void _count_write(size_t size);
+    // async mode
+    void _run();
+    void _wait_idle();
+
+    char *_data{};  // `_buffer` or the one lent by the sink
+    std::unique_ptr<char[]> _buffer;
+    size_t _size{};
+    size_t _capacity{};
+    size_t _buffer_size = def_buffer_size;
+    uint64_t _appended{};  // handed over to the sink
+    SinkPtr _sink;
+    bool _closed{};
+    bool _async{};  // as set by `set_async()`, the thread runs if the sink does not lend a buffer
+    VCDOutputStats _stats;
+
+    // async mode: the buffer being written by the thread
+    std::unique_ptr<char[]> _spare;
+    const char *_pending{};
+    size_t _pending_size{};
+    bool _stop{};
+    std::exception_ptr _error;
+    mutable std::mutex _mutex;
+    std::condition_variable _cv;
+    std::thread _thread;
+};
+
+// -----------------------------
+// Lightweight mark of a registered variable (its ident) to change value by.
+// It is trivially copyable, so no reference counting on the change path.
+struct VarHandle
+{
+    uint32_t ident;
+};
+
+// -----------------------------
+// Value change of a variable in batch of `VCDWriter::change_batch()`
+struct VarChange
+{
+    VarHandle var;
+    uint64_t value; // unsigned integer value
+};
+
+// -----------------------------
+// Lock-free single-producer single-consumer ring of value changes into
+// `VCDWriter` from one producer thread (see `VCDWriter::channel()`).
+// The producer pushes changes in nondecreasing timestamp order and marks
+// the timestep boundaries by `advance()`: its epoch is the timestamp before
+// which it pushes no more changes. The writer merges all channels in
+// timestamp order up to the least epoch in `VCDWriter::drain()`.
+class VCDChannel
+{
+public:
+    static constexpr size_t def_capacity = size_t(1u) << 16u;
+
+    explicit VCDChannel(size_t capacity = def_capacity);
+    VCDChannel(VCDChannel&&) = delete;
+    VCDChannel(const VCDChannel&) = delete;
+    VCDChannel& operator=(const VCDChannel&) = delete;
+    VCDChannel& operator=(VCDChannel&&) = delete;
+    ~VCDChannel() = default;
+
+    //! Push the change, return *false* if the ring is full
+    bool try_push(TimeStamp timestamp, VarHandle var, uint64_t value)
+    {
+        if (timestamp < _last)
+            throw VCDPhaseException{ "Out of order value change in channel" };
+        if (_head - _tail_cache > _mask)
+        {
+            _tail_cache = _tail.load(std::memory_order_acquire);
+            if (_head - _tail_cache > _mask)
+                return false;
+        }
+        _ring[_head & _mask] = Record{ timestamp, var, value };
+        _head_pub.store(++_head, std::memory_order_release);
+        _last = timestamp;
+        return true;
+    }
+    //! Push the change, wait while the ring is full
+    void push(TimeStamp timestamp, VarHandle var, uint64_t value)
+    {
+        while (!try_push(timestamp, var, value))
+            std::this_thread::yield();
+    }
+    //! Timestep boundary: no more changes before *timestamp* from this producer
+    void advance(TimeStamp timestamp)
+    {
+        if (timestamp < _last)
+            throw VCDPhaseException{ "Out of order epoch of channel" };
+        _last = timestamp;
+        _epoch.store(timestamp, std::memory_order_release);
+    }
+    //! No more changes from this producer
+    void close()
+    { _epoch.store(closed_epoch, std::memory_order_release); }
+
+private:
+    friend class VCDWriter;
+    struct Record
+    {
+        TimeStamp timestamp;
+        VarHandle var;
+        uint64_t  value;
+    };
+    static constexpr uint64_t closed_epoch = std::numeric_limits<uint64_t>::max();
+
+    std::unique_ptr<Record[]> _ring;
+    size_t _mask;
+    // producer side
+    alignas(64) size_t _head{};
+    size_t _tail_cache{};
+    TimeStamp _last{};
+    alignas(64) std::atomic<size_t> _head_pub{};
+    std::atomic<uint64_t> _epoch{};
+    // consumer side
+    alignas(64) std::atomic<size_t> _tail{};
+    size_t _read{};
+};
+using ChannelPtr = std::shared_ptr<VCDChannel>;
+
 // -----------------------------
 struct VarSearch;
 using VarSearchPtr = std::shared_ptr<VarSearch>;
 
+// -----------------------------
+struct VCDValueStore;
+using ValueStorePtr = std::shared_ptr<VCDValueStore>;
+
 // -----------------------------
 struct VCDHeader;
 struct VCDHeaderDeleter { void operator()(VCDHeader *p); };
@@ -100,20 +698,37 @@ HeadPtr makeVCDHeader(TimeScale     timescale_quan = TimeScale::ONE,
 // -----------------------------
 // Writer of a Value Change Dump file
 // A VCD file captures time-ordered changes to the value of variables
+//
+// Allocations: after the header is written (the first change at a later timestamp
+// or `flush()`), `change()`, `change_batch()` and `trigger()` by `VarPtr` or
+// `VarHandle` make no heap allocations once the scratch buffers have grown to the
+// longest value of a variable (a string var takes its longest value once).
+// It holds for the async and coalescing modes as well, once they are warm too.
+// The by-name `change()`, exceptions, `set_buffer_size()` and rolling over to the next
+// segment may allocate.
 class VCDWriter
 {
 public:
     VCDWriter(std::string filename, HeadPtr &header, unsigned init_timestamp = 0u);
+    //! write into *sink* instead of a file (e.g. `VCDMemorySink`, `VCDCallbackSink`)
+    VCDWriter(SinkPtr sink, HeadPtr &header, unsigned init_timestamp = 0u);
     VCDWriter(VCDWriter&&) = delete;
     VCDWriter(const VCDWriter&) = delete;
     VCDWriter& operator=(const VCDWriter&) = delete;
     VCDWriter& operator=(VCDWriter&&) = delete;
 
-    virtual ~VCDWriter() { close(nullptr); }
+    virtual ~VCDWriter()
+    {
+        try
+        { close(nullptr); }
+        catch (const VCDException&)
+        {} // nothing to do in destructor, e.g. an error of the sink
+    }
 
     // Register a VCD variable and return its mark to change value further.
     // Remember, all VCD variables must be registered prior to any value changes.
     // Note, *size* may be `0`, some types ("int", "real", "event") have a default size
+    // The components of *scope* by the scope separator must not be empty (e.g. `top.` or `a..b`)
     VarPtr register_var(const std::string &scope,                  // Variable belongs within the hierarchical scope
                         const std::string &name,                   // Human-readable variable idetifier
                         VariableType type = var_def_type,          // Verilog data type of variable
@@ -121,33 +736,124 @@ public:
                         const VarValue &init = {VCDValues::UNDEF}, // Initial value (optional)
                         bool duplicate_names_check = true);        // speed-up (optimisation)
 
+    // Register a VCD variable the same way, but return its lightweight handle
+    VarHandle register_handle(const std::string &scope, const std::string &name,
+                              VariableType type = var_def_type, unsigned size = 0,
+                              const VarValue &init = {VCDValues::UNDEF}, bool duplicate_names_check = true)
+    { return handle(register_var(scope, name, type, size, init, duplicate_names_check)); }
+
+    //! get handle of the registered VCD variable
+    VarHandle handle(const VarPtr &var) const;
+
     // Change variable's value in VCD stream.
     // Call this method, for all variables changed on this *timestamp*.
     // It is okay to call it multiple times with the same *timestamp*, 
     // but never call with a past *timestamp*
     // Return:  *true* if new_value is dumped into VCD file,
     //         *false* if new_value is not changed from priveios *timestamp* for a given var
-    bool change(VarPtr var, TimeStamp timestamp, const VarValue &value)
-    { return _change(std::move(var), timestamp, value, false); }
+    // The *value* is validated and copied into the output buffer, the previous
+    // value of string variable is kept in a reusable buffer (see Allocations above)
+    bool change(const VarPtr &var, TimeStamp timestamp, std::string_view value)
+    { return _change(_var(var), timestamp, value); }
+
+    bool change(VarHandle var, TimeStamp timestamp, std::string_view value)
+    { return _change(_var(var), timestamp, value); }
 
     bool change(const std::string &scope, const std::string &name, TimeStamp timestamp, const VarValue &value);
 
-    // Suspend dumping to VCD file
+    // Change variable's value by an integer, no need to render it into a string.
+    // Vector and scalar variables are dumped as binary of *value*, which must fit into the
+    // var's size (a negative *value* is taken in two's complement, e.g. for `VariableType::integer`,
+    // so a scalar takes `0`, `1` or `-1`), real variables take it as a number.
+    // A `char` is a value char (e.g. `'1'` or `'x'`), not a number
+    template <typename Int, typename = std::enable_if_t<std::is_integral_v<Int>>>
+    bool change(const VarPtr &var, TimeStamp timestamp, Int value)
+    { return _change(_var(var), timestamp, static_cast<uint64_t>(value), std::is_signed_v<Int>); }
+
+    template <typename Int, typename = std::enable_if_t<std::is_integral_v<Int>>>
+    bool change(VarHandle var, TimeStamp timestamp, Int value)
+    { return _change(_var(var), timestamp, static_cast<uint64_t>(value), std::is_signed_v<Int>); }
+
+    bool change(const VarPtr &var, TimeStamp timestamp, char value)
+    { return _change(_var(var), timestamp, std::string_view{ &value, 1 }); }
+
+    bool change(VarHandle var, TimeStamp timestamp, char value)
+    { return _change(_var(var), timestamp, std::string_view{ &value, 1 }); }
+
+    // Change real variable's value by a double. It is compared with the previous value
+    // bit by bit and dumped in the shortest form that reads back to the same double
+    bool change(const VarPtr &var, TimeStamp timestamp, double value)
+    { return _change(_var(var), timestamp, value); }
+
+    bool change(VarHandle var, TimeStamp timestamp, double value)
+    { return _change(_var(var), timestamp, value); }
+
+    // Trigger event variable at *timestamp*: `1` is dumped at this timestamp only.
+    // Events have no previous value to compare with, and `change()` of them throws
+    void trigger(const VarPtr &var, TimeStamp timestamp)
+    { _trigger(_var(var), timestamp); }
+
+    void trigger(VarHandle var, TimeStamp timestamp)
+    { _trigger(_var(var), timestamp); }
+
+    // Change values of many variables at one *timestamp*. The timestamp and the phase
+    // are checked and `#timestamp` is dumped once for the whole batch. The *changes*
+    // are applied in handle order to walk the previous values sequentially, several
+    // changes of the same variable in given order; the array itself is not modified,
+    // so it can be refilled by position for the next batch.
+    // Return the number of changes dumped into VCD file
+    size_t change_batch(TimeStamp timestamp, const VarChange *changes, size_t count);
+
+    size_t change_batch(TimeStamp timestamp, const std::vector<VarChange> &changes)
+    { return change_batch(timestamp, changes.data(), changes.size()); }
+
+    // Open a channel of value changes for one producer thread, e.g. a partition
+    // of a multithreaded simulation. Open all channels before producers start.
+    ChannelPtr channel(size_t capacity = VCDChannel::def_capacity);
+
+    // Dump the changes of all channels in timestamp order (the changes of one
+    // timestamp in order of the channels) up to the least epoch of the channels.
+    // Call it from one serializer thread, concurrently with producers.
+    // Return the number of dumped records.
+    size_t drain()
+    { return _drain(false); }
+
+    // Coalescing mode: the changes of a timestamp are kept until it advances (or `flush()`),
+    // then only the last value of each changed var is dumped, unless it is equal to the value
+    // at the start of the timestamp (e.g. a 0-1-0 glitch of delta cycles dumps nothing).
+    // `change()` returns *true* if the value differs from the previous change
+    void set_coalesce(bool coalesce);
+
+    // Suspend dumping to VCD file, the vars are dumped as `x` (`rnan` for real and `sx` for string vars)
     void dump_off(TimeStamp timestamp)
     {
-        if (_dumping && !_registering && _vars_prevs.size())
+        if (_coalesce)
+            _dump_step();
+        _timestamp_due = false;
+        if (_dumping && !_registering && _has_values())
             _dump_off(timestamp);
         _dumping = false;
     }
     // Resume dumping to VCD file
     void dump_on(TimeStamp timestamp)
     {
-        if (!_dumping && !_registering && _vars_prevs.size())
-            _ofile.print("#{:d}\n", timestamp);
+        // the changes while dumping was off are in `$dumpon`
+        if (_coalesce)
+            _dump_step();
+        _timestamp_due = false;
+        if (!_dumping && !_registering && _has_values())
+            _ofile.timestamp(timestamp);
         _dump_values("$dumpon");
         _dumping = true;
     }
 
+    // Enable or disable capture of the vars in *scope* and its subscopes, e.g. `dump_scope("top.cpu0", false)`,
+    // at *timestamp* (the current one by default). The disabled vars are dumped as `x` once (`rnan` for real
+    // and `sx` for string vars, as by `dump_off()`), also in `$dumpvars`; their changes are not dumped
+    // (their values are kept), the re-enabled ones are dumped with the current values.
+    // In coalescing mode these records replace the pending changes of the timestamp
+    void dump_scope(const std::string &scope, bool enable, const TimeStamp *timestamp = nullptr);
+
     // Flush any buffered VCD data to output file.
     // If the VCD header has not already been written, calling `flush()` will force
     // the header to be written thus disallowing any further variable registrations.
@@ -157,19 +863,29 @@ public:
             throw VCDPhaseException{ "Cannot flush() after close()" };
         if (_registering)
             _finalize_registration();
+        if (_coalesce)
+            _dump_step();
         if (timestamp != nullptr && *timestamp > _timestamp)
-            _ofile.print("#{:d}\n", *timestamp);
+            _ofile.timestamp(*timestamp);
         _ofile.flush();
     }
-    // Close VCD writer. Any buffered VCD data is flushed to the output file.
+    // Close VCD writer. Any buffered VCD data is flushed to the output file,
+    // the background thread of async mode is joined and the file is closed.
     // After `close()`, NO variable registration or value changes will be accepted.
-    // Note, the output file-stream will be closed in destructor of `VCDWriter`
     void close(const TimeStamp *timestamp = nullptr)
     {
         if (_closed)
             return;
+        // producers must be stopped, all their changes are dumped
+        if (!_channels.empty())
+            _drain(true);
+        if (_recorder_out)
+            dump_recorder();
         flush(timestamp);
+        _ofile.close();
         _closed = true;
+        if (_segment_sink)
+            _write_manifest(timestamp != nullptr && *timestamp > _timestamp ? *timestamp : _timestamp);
     }
 
     //! VCD viewer applications may display different scope types differently
@@ -178,6 +894,53 @@ public:
     void set_scope_default_type(ScopeType type)
     { _scope_def_type = type; }
 
+    //! set size of output buffer, e.g. 4-64 MiB (`VCDOutput::def_buffer_size` by default)
+    void set_buffer_size(size_t size)
+    { _ofile.set_buffer_size(size); }
+
+    //! Async mode: a background thread writes the filled output buffer, while
+    //! the changes are dumped into the second one. `flush()` waits for the writes
+    void set_async(bool async)
+    { _ofile.set_async(async); }
+    [[nodiscard]] bool async() const
+    { return _ofile.async(); }
+
+    //! Linux io_uring writes of the output file with several buffers in flight and no
+    //! extra thread. Return *false* if io_uring is not available, then `write(2)` is used.
+    //! Async mode is kept, it is on again once io_uring is off
+    bool set_io_uring(bool enable, unsigned depth = VCDUringSink::def_depth)
+    { return _ofile.set_io_uring(enable, depth); }
+    [[nodiscard]] bool io_uring() const
+    { return _ofile.io_uring(); }
+
+    using SinkFactory = std::function<SinkPtr(const std::string &filename)>;
+
+    // Rolling segments: the dump goes on in the next file once the current one has
+    // *max_bytes* bytes or covers *max_time* time units (`0` is no limit). It rolls over
+    // at a timestamp, the segment starts with the header and `$dumpvars` of the current
+    // values, so it opens standalone. The files are named by the writer's file name,
+    // e.g. `dump.vcd`, `dump_1.vcd`, `dump_2.vcd`, and opened by *factory* (`VCDFdSink`
+    // by default, written by io_uring if the output is). The manifest `dump.vcd.manifest`
+    // has a line of the file name, the first and the last timestamp (tab separated) per segment
+    void set_segments(uint64_t max_bytes, TimeStamp max_time = 0, SinkFactory factory = {});
+
+    // Flight recorder: the changes are kept in memory instead of the output, only the last
+    // *max_bytes* bytes or *max_time* time units of them (`0` is no limit). They are kept by
+    // `recorder_slices` slices, each starting with a snapshot of the values, the oldest slice is
+    // dropped when the rest still fits the limit (the bytes) or covers it (the time).
+    // Start it before the header is written
+    void set_flight_recorder(uint64_t max_bytes, TimeStamp max_time = 0);
+    // Write the recorded window into the output: the header, `$dumpvars` of the values at its
+    // start and the recorded changes. The changes after it are written as usual.
+    // `close()` calls it if the recorder is still on
+    void dump_recorder();
+
+    static constexpr unsigned recorder_slices = 8u;
+
+    //! counters of the output, e.g. time spent waiting for a free buffer in async mode
+    [[nodiscard]] VCDOutputStats output_stats() const
+    { return _ofile.stats(); }
+
     void set_scope_sep(const std::string& scope_sep)
     {
         if (scope_sep.size() == 0 || scope_sep == _scope_sep)
@@ -190,10 +953,51 @@ public:
     static const VariableType var_def_type = VariableType::integer;
 
 protected:
-    bool _change(VarPtr, TimeStamp, const VarValue&, bool);
+    bool _change(VCDVariable&, TimeStamp, std::string_view);
+    bool _change(VCDVariable&, TimeStamp, uint64_t, bool is_signed);
+    bool _change(VCDVariable&, TimeStamp, double);
+    void _change_timestamp(const VCDVariable&, TimeStamp);
+    void _set_timestamp(TimeStamp);
+    void _trigger(const VCDVariable&, TimeStamp);
+    //! registered variable by its mark
+    VCDVariable& _var(const VarPtr&) const;
+    VCDVariable& _var(VarHandle var) const
+    {
+        if (var.ident >= _vars_idents.size())
+            throw VCDTypeException{ "Invalid VarHandle" };
+        return *_vars_idents[var.ident];
+    }
+    void _change_record(const VCDVariable&);
+    // coalescing mode
+    void _start_coalescing();
+    void _dump_timestamp();
+    void _dump_step();
+    size_t _drain(bool all);
+    [[nodiscard]] bool _has_values() const;
     void _dump_off(TimeStamp);
+    //! `x` of the var: `bx` of vectors, `rnan` of real and `sx` of string vars
+    void _dump_unknown(const VCDVariable&);
     void _dump_values(const char *keyword);
-    void _scope_declaration(const std::string& scope, ScopeType type, size_t sub_beg, size_t sub_end = std::string::npos);
+    void _dump_values(const char *keyword, const VCDValueStore &values);
+    //! the header and the values at the current timestamp
+    void _dump_start();
+    // rolling segments
+    [[nodiscard]] bool _segment_full(TimeStamp timestamp) const
+    {
+        return (_segment_bytes && _ofile.bytes() >= _segment_bytes) ||
+               (_segment_time && timestamp - _segment_begin >= _segment_time);
+    }
+    void _next_segment(TimeStamp);
+    void _write_manifest(TimeStamp end);
+    // flight recorder
+    [[nodiscard]] bool _slice_full(TimeStamp timestamp) const
+    {
+        return (_recorder_bytes && _ofile.bytes() >= _recorder_bytes / recorder_slices) ||
+               (_recorder_time && timestamp - _slices.back().begin >= _recorder_time / recorder_slices);
+    }
+    void _next_slice(TimeStamp);
+    //! scope of the tree by its full name, `nullptr` if there is no such one
+    VCDScope* _find_scope(const std::string &scope) const;
     //! Dump VCD header into file
     void _write_header();
     //! Turn to dumping phase, no more variables regestration allowed
@@ -207,9 +1011,9 @@ private:
     std::string _scope_sep;
     ScopeType   _scope_def_type{};
     std::string _filename;
-    fmt::ostream _ofile;
+    VCDOutput _ofile;
 
-    std::set<ScopePtr, ScopePtrHash> _scopes;
+    ScopePtr _scopes;  // root of the tree of scopes, by the name components
     std::unordered_set<VarPtr, VarPtrHash, VarPtrEqual> _vars;
 
     // check changes of vars' values
@@ -221,7 +1025,49 @@ private:
     unsigned   _next_var_id{};
     VarSearchPtr _search;
 
-    std::unordered_map<VarPtr, VarValue> _vars_prevs;
+    // vars by ident and their previous values, the captured ones (by `dump_scope()`)
+    std::vector<VCDVariable*> _vars_idents;
+    std::vector<bool> _captured;
+    ValueStorePtr _values;
+    // channels of producer threads and their published heads
+    std::vector<ChannelPtr> _channels;
+    std::vector<size_t> _drained;
+    // scratch of the value change records, owned by the writer so that
+    // writers on different threads share nothing (no mem-alloc when warmed up)
+    VarValue _record;
+    // the changes of `change_batch()` in handle order
+    std::vector<const VarChange*> _batch;
+
+    // coalescing mode: values at the start of the timestamp, vars changed
+    // since then and their last records (by ident)
+    bool _coalesce{};
+    bool _timestamp_due{};
+    ValueStorePtr _step_values;
+    std::vector<unsigned> _step_changes;
+    std::vector<bool> _step_dirty;
+    std::vector<VarValue> _step_records;
+
+    // rolling segments: limits, the first timestamp of the current one
+    // and the manifest lines of the previous ones
+    uint64_t _segment_bytes{};
+    TimeStamp _segment_time{};
+    SinkFactory _segment_sink;
+    TimeStamp _segment_begin{};
+    std::vector<std::string> _segments;
+
+    // flight recorder: limits, the output put aside and the slices
+    // of the changes since the snapshots (the last one is being recorded)
+    struct RecorderSlice
+    {
+        TimeStamp begin;
+        bool dumping;
+        ValueStorePtr values;
+        std::shared_ptr<VCDMemorySink> changes;
+    };
+    uint64_t _recorder_bytes{};
+    TimeStamp _recorder_time{};
+    SinkPtr _recorder_out;
+    std::vector<RecorderSlice> _slices;
 };
 
 // -----------------------------
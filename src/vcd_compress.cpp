@@ -0,0 +1,247 @@
+#include <algorithm>
+#include <cstring>
+#include <utility>
+#include "vcd_writer.h"
+
+#ifdef VCDWRITER_ZLIB
+#include <zlib.h>
+#endif
+
+
+// -----------------------------
+namespace vcd {
+using namespace utils;
+
+// -----------------------------
+VCDCompressSink::VCDCompressSink(SinkPtr out, size_t block, unsigned threads) :
+    _out(std::move(out)),
+    _block(std::max(block, min_block))
+{
+    if (!_out)
+        throw VCDException{ "Invalid pointer to sink" };
+    if (!threads)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    _blocks.resize(size_t(2u) * threads);
+    for (unsigned i = 0; i < threads; ++i)
+        _workers.emplace_back(&VCDCompressSink::_run, this, i);
+}
+
+// -----------------------------
+// The derived sink closes itself, it is only for the workers of a failed construction
+VCDCompressSink::~VCDCompressSink()
+{
+    _stop();
+}
+
+// -----------------------------
+void VCDCompressSink::write(const char *data, size_t size)
+{
+    while (size)
+    {
+        Block &block = _blocks[_tail % _blocks.size()];
+        if (!block.data)
+            block.data.reset(new char[_block]);
+        const size_t part = std::min(size, _block - block.size);
+        std::memcpy(block.data.get() + block.size, data, part);
+        block.size += part;
+        data += part;
+        size -= part;
+        if (block.size == _block)
+            _submit();
+    }
+}
+
+// -----------------------------
+void VCDCompressSink::flush()
+{
+    if (_blocks[_tail % _blocks.size()].size)
+        _submit();
+    while (_head != _tail)
+        _write_done(true);
+    _out->flush();
+}
+
+// -----------------------------
+void VCDCompressSink::close()
+{
+    if (_closed)
+        return;
+    _closed = true;
+    // the workers finish the blocks and the output is closed even on error
+    std::exception_ptr error;
+    try
+    {
+        flush();
+        std::string trailer;
+        finish(trailer);
+        if (!trailer.empty())
+            _out->write(trailer.data(), trailer.size());
+    }
+    catch (const VCDException&)
+    { error = std::current_exception(); }
+    _stop();
+    try
+    { _out->close(); }
+    catch (const VCDException&)
+    {
+        if (!error)
+            error = std::current_exception();
+    }
+    if (error)
+        std::rethrow_exception(error);
+}
+
+// -----------------------------
+// Hand the filled block over to the workers, the ring is freed by the written ones
+void VCDCompressSink::_submit()
+{
+    {
+        std::lock_guard<std::mutex> lock{ _mutex };
+        ++_tail;
+    }
+    _work_cv.notify_one();
+    _write_done(_tail - _head == _blocks.size());
+}
+
+// -----------------------------
+// Write the compressed blocks in order, wait for the oldest one if *wait*
+void VCDCompressSink::_write_done(bool wait)
+{
+    std::unique_lock<std::mutex> lock{ _mutex };
+    while (_head != _tail)
+    {
+        Block &block = _blocks[_head % _blocks.size()];
+        if (wait)
+            _done_cv.wait(lock, [&block] { return block.done; });
+        else if (!block.done)
+            return;
+        wait = false;
+        lock.unlock();
+        // the block is not touched by the workers until it is submitted again
+        block.done = false;
+        const std::exception_ptr error = std::exchange(block.error, nullptr);
+        if (!error)
+        {
+            _out->write(block.out.data(), block.out.size());
+            written(block.size, block.out.size());
+        }
+        block.size = 0;
+        lock.lock();
+        ++_head;
+        if (error)
+            std::rethrow_exception(error);
+    }
+}
+
+// -----------------------------
+void VCDCompressSink::_stop()
+{
+    {
+        std::lock_guard<std::mutex> lock{ _mutex };
+        _stopped = true;
+    }
+    _work_cv.notify_all();
+    for (auto &worker : _workers)
+    {
+        if (worker.joinable())
+            worker.join();
+    }
+}
+
+// -----------------------------
+// Worker thread: compress the submitted blocks until stopped
+void VCDCompressSink::_run(unsigned worker)
+{
+    std::unique_lock<std::mutex> lock{ _mutex };
+    for (;;)
+    {
+        _work_cv.wait(lock, [this] { return _next != _tail || _stopped; });
+        if (_next == _tail)
+            return;
+        Block &block = _blocks[_next++ % _blocks.size()];
+        lock.unlock();
+        try
+        { compress(worker, block.data.get(), block.size, block.out); }
+        catch (...) // it is rethrown on the writer's thread
+        { block.error = std::current_exception(); }
+        lock.lock();
+        block.done = true;
+        _done_cv.notify_all();
+    }
+}
+
+#ifdef VCDWRITER_ZLIB
+// -----------------------------
+struct VCDGzipSink::Stream
+{
+    z_stream z{};
+    bool init{};
+
+    ~Stream()
+    {
+        if (init)
+            deflateEnd(&z);
+    }
+};
+#else
+struct VCDGzipSink::Stream {};
+#endif
+
+// -----------------------------
+VCDGzipSink::VCDGzipSink(SinkPtr out, int level, size_t block, unsigned threads) :
+    VCDCompressSink(std::move(out), block, threads),
+    _streams(new Stream[VCDCompressSink::threads()]),
+    _level(level)
+{
+#ifndef VCDWRITER_ZLIB
+    throw VCDException{ "Gzip output is not supported, the library is built without zlib" };
+#endif
+    if (_level < 0 || _level > 9)
+        throw VCDException{ format("Invalid compression level '%d'", _level) };
+}
+
+// -----------------------------
+VCDGzipSink::VCDGzipSink(const std::string &filename, int level, size_t block, unsigned threads) :
+    VCDGzipSink(std::make_shared<VCDFdSink>(filename), level, block, threads)
+{}
+
+// -----------------------------
+VCDGzipSink::~VCDGzipSink()
+{
+    try
+    { close(); }
+    catch (const VCDException&)
+    {} // nothing to do in destructor
+}
+
+// -----------------------------
+// One gzip member of the block, the stream of the worker is reused by `deflateReset()`
+void VCDGzipSink::compress(unsigned worker, const char *data, size_t size, std::string &out)
+{
+#ifdef VCDWRITER_ZLIB
+    Stream &stream = _streams[worker];
+    z_stream &z = stream.z;
+    if (!stream.init)
+    {
+        // 16 + window bits is the gzip wrapper
+        if (deflateInit2(&z, _level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw VCDException{ "Cannot initialize zlib stream" };
+        stream.init = true;
+    }
+    else
+        deflateReset(&z);
+    out.resize(deflateBound(&z, static_cast<uLong>(size)));
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    z.avail_in = static_cast<uInt>(size);
+    z.next_out = reinterpret_cast<Bytef*>(out.data());
+    z.avail_out = static_cast<uInt>(out.size());
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END)
+        throw VCDException{ format("Cannot compress block: %s", z.msg ? z.msg : "zlib error") };
+    out.resize(z.total_out);
+#else
+    (void)worker; (void)data; (void)size; (void)out;
+#endif
+}
+
+// -----------------------------
+}
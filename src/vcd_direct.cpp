@@ -0,0 +1,153 @@
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include "vcd_writer.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+// -----------------------------
+namespace vcd {
+using namespace utils;
+
+#ifndef _WIN32
+// -----------------------------
+VCDDirectSink::VCDDirectSink(const std::string &filename, size_t block) :
+    _block(block)
+{
+    if (!_block || (_block & (_block - 1u)))
+        throw VCDException{ format("Invalid block size '%zu', must be a power of 2", _block) };
+#ifdef O_DIRECT
+    _fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    _direct = _fd >= 0;
+    // e.g. tmpfs refuses it
+    if (_fd < 0 && errno == EINVAL)
+#endif
+        _fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (_fd < 0)
+        throw VCDException{ format("Cannot open file '%s': %s", filename.c_str(), std::strerror(errno)) };
+#if defined(__APPLE__)
+    _direct = ::fcntl(_fd, F_NOCACHE, 1) == 0;
+#endif
+}
+
+// -----------------------------
+VCDDirectSink::~VCDDirectSink()
+{
+    try
+    { close(); }
+    catch (const VCDException&)
+    {} // nothing to do in destructor
+}
+
+// -----------------------------
+void VCDDirectSink::write(const char *data, size_t size)
+{
+    std::memcpy(acquire(size), data, size);
+    commit(size);
+}
+
+// -----------------------------
+char* VCDDirectSink::acquire(size_t size)
+{
+    if (_fd < 0)
+        throw VCDException{ "Cannot write into closed file" };
+    // whole blocks, so that the last one can be padded
+    const size_t need = (_tail + size + _block - 1u) / _block * _block;
+    if (need > _capacity)
+    {
+        std::unique_ptr<char[]> storage{ new char[need + _block] };
+        char *buffer = storage.get() + (_block - reinterpret_cast<uintptr_t>(storage.get()) % _block) % _block;
+        if (_tail)
+            std::memcpy(buffer, _buffer, _tail);
+        _storage = std::move(storage);
+        _buffer = buffer;
+        _capacity = need;
+    }
+    return _buffer + _tail;
+}
+
+// -----------------------------
+void VCDDirectSink::commit(size_t size)
+{
+    _tail += size;
+    const size_t aligned = _tail / _block * _block;
+    if (!aligned)
+        return;
+    _write_blocks(aligned);
+    // carry the unaligned tail over to the buffer start
+    _tail -= aligned;
+    std::memmove(_buffer, _buffer + aligned, _tail);
+}
+
+// -----------------------------
+void VCDDirectSink::close()
+{
+    if (_fd < 0)
+        return;
+    int err = 0;
+    try
+    {
+        if (_tail)
+        {
+            // the padded last block, then the padding is trimmed
+            std::memset(_buffer + _tail, 0, _block - _tail);
+            _write_blocks(_block);
+            if (::ftruncate(_fd, static_cast<off_t>(_written - _block + _tail)) != 0)
+                err = errno;
+            _tail = 0;
+        }
+    }
+    catch (const VCDException&)
+    {
+        ::close(_fd);
+        _fd = -1;
+        throw;
+    }
+    ::close(_fd);
+    _fd = -1;
+    if (err)
+        throw VCDException{ format("Cannot truncate file: %s", std::strerror(err)) };
+}
+
+// -----------------------------
+// Write *size* bytes (whole blocks) of the buffer start
+void VCDDirectSink::_write_blocks(size_t size)
+{
+    const char *data = _buffer;
+    while (size)
+    {
+        const ssize_t res = ::write(_fd, data, size);
+        if (res < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw VCDException{ format("Cannot write into file: %s", std::strerror(errno)) };
+        }
+        // O_DIRECT writes whole blocks or fails, the page cache ones may be short
+        data += res;
+        size -= static_cast<size_t>(res);
+        _written += static_cast<uint64_t>(res);
+    }
+}
+
+#else // _WIN32
+// -----------------------------
+VCDDirectSink::VCDDirectSink(const std::string&, size_t block) :
+    _block(block)
+{
+    throw VCDException{ "Direct I/O output is not supported on Windows" };
+}
+VCDDirectSink::~VCDDirectSink() = default;
+void VCDDirectSink::write(const char*, size_t) {}
+char* VCDDirectSink::acquire(size_t) { return nullptr; }
+void VCDDirectSink::commit(size_t) {}
+void VCDDirectSink::close() {}
+void VCDDirectSink::_write_blocks(size_t) {}
+#endif
+
+// -----------------------------
+}
@@ -0,0 +1,164 @@
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include "vcd_writer.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+
+// -----------------------------
+namespace vcd {
+using namespace utils;
+
+#ifndef _WIN32
+namespace {
+// -----------------------------
+uint64_t round_up(uint64_t value, uint64_t step)
+{
+    return (value + step - 1u) / step * step;
+}
+
+// -----------------------------
+// Allocate the blocks of the file from *from* up to *size* (the file grows), so that
+// a full disk is an error here and not `SIGBUS` on a store into the mapping.
+// Return `errno`, `EOPNOTSUPP` if the filesystem (or the OS) cannot do it
+#ifdef __linux__
+int reserve(int fd, uint64_t from, uint64_t size)
+{
+    while (::fallocate(fd, 0, static_cast<off_t>(from), static_cast<off_t>(size - from)) != 0)
+    {
+        if (errno != EINTR)
+            return errno;
+    }
+    return 0;
+}
+#else
+int reserve(int, uint64_t, uint64_t)
+{ return EOPNOTSUPP; }
+#endif
+} // namespace
+
+// -----------------------------
+VCDMmapSink::VCDMmapSink(const std::string &filename, size_t extent) :
+    _page(static_cast<size_t>(::sysconf(_SC_PAGESIZE)))
+{
+    _extent = static_cast<size_t>(round_up(std::max(extent, _page), _page));
+    _fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (_fd < 0)
+        throw VCDException{ format("Cannot open file '%s': %s", filename.c_str(), std::strerror(errno)) };
+}
+
+// -----------------------------
+VCDMmapSink::~VCDMmapSink()
+{
+    try
+    { close(); }
+    catch (const VCDException&)
+    {} // nothing to do in destructor
+}
+
+// -----------------------------
+void VCDMmapSink::write(const char *data, size_t size)
+{
+    std::memcpy(acquire(size), data, size);
+    commit(size);
+}
+
+// -----------------------------
+char* VCDMmapSink::acquire(size_t size)
+{
+    if (_fd < 0)
+        throw VCDException{ "Cannot write into closed file" };
+    if (!_map || _pos + size > _map_offset + _map_size)
+        _remap(_pos + size);
+    return _map + (_pos - _map_offset);
+}
+
+// -----------------------------
+void VCDMmapSink::commit(size_t size)
+{
+    _pos += size;
+    // the written pages stay in the page cache, the process does not need them
+    const uint64_t done = _pos / _page * _page;
+    if (done > _dropped)
+    {
+        ::madvise(_map + (_dropped - _map_offset), static_cast<size_t>(done - _dropped), MADV_DONTNEED);
+        _dropped = done;
+    }
+}
+
+// -----------------------------
+void VCDMmapSink::close()
+{
+    if (_fd < 0)
+        return;
+    _unmap();
+    // trim the last extent to the written size
+    const int res = ::ftruncate(_fd, static_cast<off_t>(_pos));
+    const int err = errno;
+    ::close(_fd);
+    _fd = -1;
+    if (res != 0)
+        throw VCDException{ format("Cannot truncate file: %s", std::strerror(err)) };
+}
+
+// -----------------------------
+// Map the window from the page of the write head up to *end* at least
+void VCDMmapSink::_remap(uint64_t end)
+{
+    _unmap();
+    _map_offset = _pos / _page * _page;
+    _map_size = static_cast<size_t>(round_up(std::max<uint64_t>(end - _map_offset, _extent), _page));
+    if (_map_offset + _map_size > _file_size)
+    {
+        const uint64_t size = round_up(_map_offset + _map_size, _extent);
+        const int err = reserve(_fd, _file_size, size);
+        if (err == EOPNOTSUPP)
+        {
+            // sparse then: a full disk is not detected
+            if (::ftruncate(_fd, static_cast<off_t>(size)) != 0)
+                throw VCDException{ format("Cannot grow file: %s", std::strerror(errno)) };
+        }
+        else if (err != 0)
+            throw VCDException{ format("Cannot grow file: %s", std::strerror(err)) };
+        _file_size = size;
+    }
+    void *map = ::mmap(nullptr, _map_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, static_cast<off_t>(_map_offset));
+    if (map == MAP_FAILED)
+        throw VCDException{ format("Cannot map file: %s", std::strerror(errno)) };
+    _map = static_cast<char*>(map);
+    _dropped = _map_offset;
+    ::madvise(_map, _map_size, MADV_SEQUENTIAL);
+}
+
+// -----------------------------
+void VCDMmapSink::_unmap()
+{
+    if (!_map)
+        return;
+    ::munmap(_map, _map_size);
+    _map = nullptr;
+}
+
+#else // _WIN32
+// -----------------------------
+VCDMmapSink::VCDMmapSink(const std::string&, size_t extent) :
+    _extent(extent), _page(0)
+{
+    throw VCDException{ "Memory-mapped output is not supported on Windows" };
+}
+VCDMmapSink::~VCDMmapSink() = default;
+void VCDMmapSink::write(const char*, size_t) {}
+char* VCDMmapSink::acquire(size_t) { return nullptr; }
+void VCDMmapSink::commit(size_t) {}
+void VCDMmapSink::close() {}
+void VCDMmapSink::_remap(uint64_t) {}
+void VCDMmapSink::_unmap() {}
+#endif
+
+// -----------------------------
+}
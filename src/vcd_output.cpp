@@ -0,0 +1,434 @@
+#include <cerrno>
+#include <fcntl.h>
+#include <algorithm>
+#include <chrono>
+#include <utility>
+#include "vcd_writer.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <sys/stat.h>
+#define VCD_OPEN_FLAGS (_O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY)
+#define VCD_OPEN_MODE (_S_IREAD | _S_IWRITE)
+#else
+#include <unistd.h>
+#define VCD_OPEN_FLAGS (O_WRONLY | O_CREAT | O_TRUNC)
+#define VCD_OPEN_MODE 0644
+#endif
+
+
+// -----------------------------
+namespace vcd {
+using namespace utils;
+
+namespace {
+// -----------------------------
+// Write all *size* bytes of *data* into the file *fd*
+void write_all(int fd, const char *data, size_t size)
+{
+    while (size)
+    {
+#ifdef _WIN32
+        const int res = ::_write(fd, data, static_cast<unsigned>(std::min<size_t>(size, 1u << 30)));
+#else
+        const ssize_t res = ::write(fd, data, size);
+#endif
+        if (res < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw VCDException{ format("Cannot write into file: %s", std::strerror(errno)) };
+        }
+        data += res;
+        size -= static_cast<size_t>(res);
+    }
+}
+} // namespace
+
+// -----------------------------
+VCDFdSink::VCDFdSink(const std::string &filename) :
+    _owned(true)
+{
+#ifdef _WIN32
+    _fd = ::_open(filename.c_str(), VCD_OPEN_FLAGS, VCD_OPEN_MODE);
+#else
+    _fd = ::open(filename.c_str(), VCD_OPEN_FLAGS, VCD_OPEN_MODE);
+#endif
+    if (_fd < 0)
+        throw VCDException{ format("Cannot open file '%s': %s", filename.c_str(), std::strerror(errno)) };
+}
+
+// -----------------------------
+VCDFdSink::VCDFdSink(int fd, bool owned) :
+    _fd(fd),
+    _owned(owned)
+{
+    if (_fd < 0)
+        throw VCDException{ "Invalid file descriptor" };
+}
+
+// -----------------------------
+VCDFdSink::~VCDFdSink()
+{
+    close();
+}
+
+// -----------------------------
+void VCDFdSink::write(const char *data, size_t size)
+{
+    write_all(_fd, data, size);
+}
+
+// -----------------------------
+void VCDFdSink::close()
+{
+    if (!_owned || _fd < 0)
+        return;
+#ifdef _WIN32
+    ::_close(_fd);
+#else
+    ::close(_fd);
+#endif
+    _fd = -1;
+}
+
+// -----------------------------
+VCDStreamSink::VCDStreamSink(std::FILE *stream) :
+    _stream(stream)
+{
+    if (!_stream)
+        throw VCDException{ "Invalid stream" };
+}
+
+// -----------------------------
+void VCDStreamSink::write(const char *data, size_t size)
+{
+    if (std::fwrite(data, 1, size, _stream) != size)
+        throw VCDException{ format("Cannot write into stream: %s", std::strerror(errno)) };
+}
+
+// -----------------------------
+void VCDStreamSink::flush()
+{
+    if (std::fflush(_stream) != 0)
+        throw VCDException{ format("Cannot flush stream: %s", std::strerror(errno)) };
+}
+
+// -----------------------------
+void VCDStreamSink::close()
+{
+    flush();
+}
+
+// -----------------------------
+VCDOutput::VCDOutput(const std::string &filename) :
+    _sink(std::make_shared<VCDFdSink>(filename))
+{}
+
+// -----------------------------
+VCDOutput::VCDOutput(SinkPtr sink) :
+    _sink(std::move(sink))
+{
+    if (!_sink)
+        throw VCDException{ "Invalid pointer to sink" };
+}
+
+// -----------------------------
+VCDOutput::~VCDOutput()
+{
+    try
+    { close(); }
+    catch (const VCDException&)
+    {} // nothing to do in destructor
+}
+
+// -----------------------------
+void VCDOutput::close()
+{
+    if (_closed)
+        return;
+    // the sink is closed even if the last write fails
+    std::exception_ptr error;
+    try
+    { flush(); }
+    catch (const VCDException&)
+    { error = std::current_exception(); }
+    set_async(false);
+    try
+    { _sink->close(); }
+    catch (const VCDException&)
+    {
+        if (!error)
+            error = std::current_exception();
+    }
+    _closed = true;
+    if (error)
+        std::rethrow_exception(error);
+}
+
+// -----------------------------
+void VCDOutput::reopen(SinkPtr sink)
+{
+    if (!sink)
+        throw VCDException{ "Invalid pointer to sink" };
+    const bool async = _async;
+    const auto uring = std::dynamic_pointer_cast<VCDUringSink>(_sink);
+    const unsigned depth = uring ? uring->depth() : 0u;
+    close();
+    auto file = std::dynamic_pointer_cast<VCDFdSink>(sink);
+    if (depth && file)
+        sink = std::make_shared<VCDUringSink>(std::move(file), depth);
+    _sink = std::move(sink);
+    _closed = false;
+    // the buffer is taken on demand, from the new sink if it lends one
+    _data = nullptr;
+    _size = 0;
+    _capacity = 0;
+    _appended = 0;
+    set_async(async);
+}
+
+// -----------------------------
+SinkPtr VCDOutput::replace_sink(SinkPtr sink)
+{
+    if (!sink)
+        throw VCDException{ "Invalid pointer to sink" };
+    // the background thread is idle after `flush()`, it takes the sink along with the next buffer
+    flush();
+    std::swap(_sink, sink);
+    _data = nullptr;
+    _size = 0;
+    _capacity = 0;
+    _appended = 0;
+    return sink;
+}
+
+// -----------------------------
+void VCDOutput::set_buffer_size(size_t size)
+{
+    flush();
+    _buffer_size = std::max(size, min_buffer_size);
+    _data = nullptr;
+    _buffer.reset();
+    _spare.reset();
+    _capacity = 0;
+}
+
+// -----------------------------
+void VCDOutput::set_async(bool async)
+{
+    _async = async;
+    if (async == _thread.joinable() || _sink->lends_buffer())
+        return;
+    flush();
+    if (async)
+    {
+        _stop = false;
+        _thread = std::thread{ &VCDOutput::_run, this };
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock{ _mutex };
+        _stop = true;
+    }
+    _cv.notify_all();
+    _thread.join();
+    _spare.reset();
+}
+
+// -----------------------------
+bool VCDOutput::set_io_uring(bool enable, unsigned depth)
+{
+    auto uring = std::dynamic_pointer_cast<VCDUringSink>(_sink);
+    auto file = std::dynamic_pointer_cast<VCDFdSink>(_sink);
+    if (!uring && enable && !file)
+        throw VCDException{ "io_uring writes need a file descriptor sink" };
+
+    // the thread writes into the sink: it is stopped for the swap and goes on with the new
+    // one (no thread while io_uring lends the buffers)
+    const bool async = _async;
+    flush();
+    set_async(false);
+    if (uring && !enable)
+        _sink = uring->detach();
+    else if (!uring && enable)
+    {
+        uring = std::make_shared<VCDUringSink>(std::move(file), depth);
+        _sink = uring;
+    }
+    // the buffer is taken from the new sink on demand
+    _data = nullptr;
+    _size = 0;
+    _capacity = 0;
+    set_async(async);
+    return enable && uring->active();
+}
+
+// -----------------------------
+bool VCDOutput::io_uring() const
+{
+    const auto uring = std::dynamic_pointer_cast<VCDUringSink>(_sink);
+    return uring && uring->active();
+}
+
+// -----------------------------
+VCDOutputStats VCDOutput::stats() const
+{
+    std::lock_guard<std::mutex> lock{ _mutex };
+    return _stats;
+}
+
+// -----------------------------
+void VCDOutput::flush()
+{
+    if (_sink->lends_buffer())
+        _commit();
+    else
+    {
+        _write();
+        if (_thread.joinable())
+            _wait_idle();
+    }
+    _sink->flush();
+}
+
+// -----------------------------
+void VCDOutput::_write()
+{
+    if (_sink->lends_buffer())
+    {
+        _commit();
+        _data = _sink->acquire(_buffer_size);
+        _capacity = _buffer_size;
+        return;
+    }
+    _appended += _size;
+    std::exception_ptr error;
+    if (_size && !_thread.joinable())
+        _write_sink(_data, _size);
+    else if (_size)
+    {
+        // hand the filled buffer over to the thread, wait while it writes the previous one
+        std::unique_lock<std::mutex> lock{ _mutex };
+        if (_pending)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            _cv.wait(lock, [this] { return _pending == nullptr; });
+            const auto ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count());
+            ++_stats.stalls;
+            _stats.stall_ns += ns;
+            _stats.max_stall_ns = std::max(_stats.max_stall_ns, ns);
+        }
+        error = std::exchange(_error, nullptr);
+        _pending = _data;
+        _pending_size = _size;
+        std::swap(_buffer, _spare);
+        _data = _buffer.get();
+        lock.unlock();
+        _cv.notify_all();
+    }
+    _size = 0;
+    // the buffer is allocated on the first use
+    if (!_buffer)
+        _buffer.reset(new char[_buffer_size]);
+    _data = _buffer.get();
+    _capacity = _buffer_size;
+    if (error)
+        std::rethrow_exception(error);
+}
+
+// -----------------------------
+void VCDOutput::_append_long(const char *data, size_t size)
+{
+    _write();
+    if (size > _capacity && _sink->lends_buffer())
+    {
+        _data = _sink->acquire(size);
+        _capacity = size;
+    }
+    if (size <= _capacity)
+    {
+        std::memcpy(_data, data, size);
+        _size = size;
+        return;
+    }
+    // larger than the whole buffer, written after the pending one
+    if (_thread.joinable())
+        _wait_idle();
+    _appended += size;
+    _write_sink(data, size);
+}
+
+// -----------------------------
+void VCDOutput::_write_sink(const char *data, size_t size)
+{
+    _sink->write(data, size);
+    _count_write(size);
+}
+
+// -----------------------------
+// Commit the data in the lent buffer, the next one is acquired on demand
+void VCDOutput::_commit()
+{
+    _appended += _size;
+    if (_size)
+    {
+        _sink->commit(_size);
+        _count_write(_size);
+    }
+    _data = nullptr;
+    _size = 0;
+    _capacity = 0;
+}
+
+// -----------------------------
+void VCDOutput::_count_write(size_t size)
+{
+    std::lock_guard<std::mutex> lock{ _mutex };
+    ++_stats.writes;
+    _stats.bytes += size;
+}
+
+// -----------------------------
+void VCDOutput::_wait_idle()
+{
+    std::unique_lock<std::mutex> lock{ _mutex };
+    _cv.wait(lock, [this] { return _pending == nullptr; });
+    if (_error)
+        std::rethrow_exception(std::exchange(_error, nullptr));
+}
+
+// -----------------------------
+// Background thread of async mode: write the buffers handed over by `_write()`
+void VCDOutput::_run()
+{
+    std::unique_lock<std::mutex> lock{ _mutex };
+    for (;;)
+    {
+        _cv.wait(lock, [this] { return _pending != nullptr || _stop; });
+        if (!_pending)
+            return;
+        const char *data = _pending;
+        const size_t size = _pending_size;
+        lock.unlock();
+        std::exception_ptr error;
+        try
+        { _sink->write(data, size); }
+        catch (...) // e.g. of a callback, it is rethrown on the writer's thread
+        { error = std::current_exception(); }
+        lock.lock();
+        if (error)
+            _error = error;
+        else
+        {
+            ++_stats.writes;
+            _stats.bytes += size;
+        }
+        _pending = nullptr;
+        _cv.notify_all();
+    }
+}
+
+// -----------------------------
+}
@@ -0,0 +1,193 @@
+#include <cstddef>
+#include <cstring>
+#include "vcd_writer.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define VCD_SIMD_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define VCD_TARGET_AVX2
+#else
+#define VCD_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+
+// -----------------------------
+namespace vcd::utils {
+namespace {
+// -----------------------------
+// Lowercase (`X` and `Z`) and validate `VCDValues` chars one by one
+inline bool digits_scalar(char *dst, const char *src, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        const char c = src[i];
+        const char l = char(c | 0x20);
+        if (c != VCDValues::ZERO && c != VCDValues::ONE && l != VCDValues::UNDEF && l != VCDValues::HIGHV)
+            return false;
+        dst[i] = l;
+    }
+    return true;
+}
+
+// -----------------------------
+void fill_scalar(char *dst, size_t size)
+{
+    std::memset(dst, VCDValues::ZERO, size);
+}
+
+#ifdef VCD_SIMD_X86
+// -----------------------------
+// The same 16 chars at a time, the tail is done by an overlapping last block
+bool digits_sse2(char *dst, const char *src, size_t size)
+{
+    if (size < 16u)
+        return digits_scalar(dst, src, size);
+
+    const __m128i zero = _mm_set1_epi8(VCDValues::ZERO);
+    const __m128i one = _mm_set1_epi8(VCDValues::ONE);
+    const __m128i undef = _mm_set1_epi8(VCDValues::UNDEF);
+    const __m128i highv = _mm_set1_epi8(VCDValues::HIGHV);
+    const __m128i lower = _mm_set1_epi8(0x20);
+
+    for (size_t i = 0; i < size; i += 16u)
+    {
+        if (i + 16u > size)
+            i = size - 16u;
+        const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        const __m128i l = _mm_or_si128(c, lower);
+        const __m128i ok = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, zero), _mm_cmpeq_epi8(c, one)),
+                                        _mm_or_si128(_mm_cmpeq_epi8(l, undef), _mm_cmpeq_epi8(l, highv)));
+        if (_mm_movemask_epi8(ok) != 0xFFFF)
+            return false;
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), l);
+    }
+    return true;
+}
+
+// -----------------------------
+void fill_sse2(char *dst, size_t size)
+{
+    if (size < 16u)
+        return fill_scalar(dst, size);
+
+    const __m128i zero = _mm_set1_epi8(VCDValues::ZERO);
+    for (size_t i = 0; i + 16u <= size; i += 16u)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), zero);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + size - 16u), zero);
+}
+
+// -----------------------------
+// The same 32 chars at a time
+VCD_TARGET_AVX2 bool digits_avx2(char *dst, const char *src, size_t size)
+{
+    if (size < 32u)
+        return digits_sse2(dst, src, size);
+
+    const __m256i zero = _mm256_set1_epi8(VCDValues::ZERO);
+    const __m256i one = _mm256_set1_epi8(VCDValues::ONE);
+    const __m256i undef = _mm256_set1_epi8(VCDValues::UNDEF);
+    const __m256i highv = _mm256_set1_epi8(VCDValues::HIGHV);
+    const __m256i lower = _mm256_set1_epi8(0x20);
+
+    for (size_t i = 0; i < size; i += 32u)
+    {
+        if (i + 32u > size)
+            i = size - 32u;
+        const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        const __m256i l = _mm256_or_si256(c, lower);
+        const __m256i ok = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(c, zero), _mm256_cmpeq_epi8(c, one)),
+                                           _mm256_or_si256(_mm256_cmpeq_epi8(l, undef), _mm256_cmpeq_epi8(l, highv)));
+        if (_mm256_movemask_epi8(ok) != -1)
+            return false;
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), l);
+    }
+    return true;
+}
+
+// -----------------------------
+VCD_TARGET_AVX2 void fill_avx2(char *dst, size_t size)
+{
+    if (size < 32u)
+        return fill_sse2(dst, size);
+
+    const __m256i zero = _mm256_set1_epi8(VCDValues::ZERO);
+    for (size_t i = 0; i + 32u <= size; i += 32u)
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), zero);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + size - 32u), zero);
+}
+
+// -----------------------------
+bool has_avx2()
+{
+#ifdef _MSC_VER
+    int regs[4]{};
+    __cpuid(regs, 0);
+    if (regs[0] < 7)
+        return false;
+    __cpuid(regs, 1);
+    // OS saves the YMM registers
+    if (!(regs[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif // VCD_SIMD_X86
+
+// -----------------------------
+struct DigitsKernel
+{
+    bool (*digits)(char*, const char*, size_t);
+    void (*fill)(char*, size_t);
+    const char *name;
+};
+
+// -----------------------------
+// Pick the widest kernel the CPU supports, once
+const DigitsKernel& kernel()
+{
+    static const DigitsKernel selected = []() -> DigitsKernel {
+#ifdef VCD_SIMD_X86
+        if (has_avx2())
+            return { digits_avx2, fill_avx2, "avx2" };
+        return { digits_sse2, fill_sse2, "sse2" };
+#else
+        return { digits_scalar, fill_scalar, "scalar" };
+#endif
+    }();
+    return selected;
+}
+} // namespace
+
+// -----------------------------
+bool vector_digits(char *dst, const char *src, size_t size, size_t width)
+{
+    // short vectors (the common 8/16-bit buses): the call through the kernel
+    // and its fallbacks cost more than the scalar loop itself
+    if (width < 32u)
+    {
+        for (size_t i = size; i < width; ++i)
+            *dst++ = VCDValues::ZERO;
+        return digits_scalar(dst, src, size);
+    }
+
+    const DigitsKernel &k = kernel();
+    if (size < width)
+        k.fill(dst, width - size);
+    return k.digits(dst + (width - size), src, size);
+}
+
+// -----------------------------
+const char* vector_digits_isa()
+{
+    return kernel().name;
+}
+
+// -----------------------------
+}
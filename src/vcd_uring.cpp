@@ -0,0 +1,325 @@
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <utility>
+#include "vcd_writer.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define VCD_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+
+// -----------------------------
+namespace vcd {
+using namespace utils;
+
+#ifdef VCD_IO_URING
+// -----------------------------
+// The rings of io_uring by the raw syscalls (no liburing): the writes of the
+// buffers are submitted one by one, the completions are reaped in any order
+struct VCDUringSink::Ring
+{
+    int fd = -1;
+    void *sq_map = MAP_FAILED;
+    size_t sq_size{};
+    void *cq_map = MAP_FAILED;
+    size_t cq_size{};
+    io_uring_sqe *sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqes_size{};
+    unsigned *sq_tail{}, *sq_mask{}, *sq_array{};
+    unsigned *cq_head{}, *cq_tail{}, *cq_mask{};
+    io_uring_cqe *cqes{};
+    std::vector<iovec> iovecs;  // per buffer
+
+    //! return `nullptr` if io_uring is not available (e.g. old kernel or seccomp)
+    static std::unique_ptr<Ring> open(unsigned entries)
+    {
+        std::unique_ptr<Ring> ring{ new Ring };
+        io_uring_params params{};
+        ring->fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if (ring->fd < 0)
+            return nullptr;
+
+        ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            ring->sq_size = ring->cq_size = std::max(ring->sq_size, ring->cq_size);
+        ring->sq_map = ::mmap(nullptr, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              ring->fd, IORING_OFF_SQ_RING);
+        if (ring->sq_map == MAP_FAILED)
+            return nullptr;
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            ring->cq_map = ring->sq_map;
+        else
+            ring->cq_map = ::mmap(nullptr, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                  ring->fd, IORING_OFF_CQ_RING);
+        ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        ring->sqes = static_cast<io_uring_sqe*>(::mmap(nullptr, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES));
+        if (ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED)
+            return nullptr;
+
+        char *sq = static_cast<char*>(ring->sq_map), *cq = static_cast<char*>(ring->cq_map);
+        ring->sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        ring->sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        ring->sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        ring->cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        ring->cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        ring->cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        ring->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        ring->iovecs.resize(entries);
+        return ring;
+    }
+
+    ~Ring()
+    {
+        if (sqes != MAP_FAILED)
+            ::munmap(sqes, sqes_size);
+        if (cq_map != MAP_FAILED && cq_map != sq_map)
+            ::munmap(cq_map, cq_size);
+        if (sq_map != MAP_FAILED)
+            ::munmap(sq_map, sq_size);
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    //! submit the write of *size* bytes of *data* at *offset* of *file*; return *false*
+    //! if the kernel does not take it (the entry is taken back from the ring then)
+    [[nodiscard]] bool submit(int file, unsigned index, const char *data, size_t size, uint64_t offset)
+    {
+        iovecs[index] = { const_cast<char*>(data), size };
+        // the only submitter: the tail is not changed by the kernel
+        const unsigned tail = *sq_tail;
+        const unsigned slot = tail & *sq_mask;
+        io_uring_sqe &sqe = sqes[slot];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_WRITEV;
+        sqe.fd = file;
+        sqe.addr = reinterpret_cast<uint64_t>(&iovecs[index]);
+        sqe.len = 1u;
+        sqe.off = offset;
+        sqe.user_data = index;
+        sq_array[slot] = slot;
+        __atomic_store_n(sq_tail, tail + 1u, __ATOMIC_RELEASE);
+
+        while (::syscall(__NR_io_uring_enter, fd, 1u, 0u, 0u, nullptr, 0u) < 0)
+        {
+            if (errno != EINTR && errno != EAGAIN)
+            {
+                // not consumed: no later enter submits it, nor is its completion waited for
+                __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //! call *done(index, result)* for the completed writes, wait for one if *wait*
+    template <typename Func>
+    void reap(bool wait, Func &&done)
+    {
+        unsigned head = *cq_head;
+        if (wait && head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        {
+            while (::syscall(__NR_io_uring_enter, fd, 0u, 1u, IORING_ENTER_GETEVENTS, nullptr, 0u) < 0)
+            {
+                if (errno != EINTR)
+                    throw VCDException{ format("Cannot wait for write: %s", std::strerror(errno)) };
+            }
+        }
+        const unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            const io_uring_cqe &cqe = cqes[head & *cq_mask];
+            done(static_cast<unsigned>(cqe.user_data), cqe.res);
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+};
+
+namespace {
+// -----------------------------
+bool file_offset(int fd, uint64_t &offset)
+{
+    const off_t pos = ::lseek(fd, 0, SEEK_CUR);
+    if (pos < 0)
+        return false;
+    offset = static_cast<uint64_t>(pos);
+    return true;
+}
+
+// -----------------------------
+// Finish a short (or not submitted) write by `pwrite(2)`
+void pwrite_all(int fd, const char *data, size_t size, uint64_t offset)
+{
+    while (size)
+    {
+        const ssize_t res = ::pwrite(fd, data, size, static_cast<off_t>(offset));
+        if (res < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw VCDException{ format("Cannot write into file: %s", std::strerror(errno)) };
+        }
+        data += res;
+        size -= static_cast<size_t>(res);
+        offset += static_cast<uint64_t>(res);
+    }
+}
+} // namespace
+
+#else // no io_uring
+// -----------------------------
+struct VCDUringSink::Ring
+{
+    static std::unique_ptr<Ring> open(unsigned)
+    { return nullptr; }
+    bool submit(int, unsigned, const char*, size_t, uint64_t)
+    { return false; }
+    template <typename Func>
+    void reap(bool, Func&&) {}
+};
+
+namespace {
+bool file_offset(int, uint64_t&) { return false; }
+void pwrite_all(int, const char*, size_t, uint64_t) {}
+} // namespace
+#endif
+
+// -----------------------------
+VCDUringSink::VCDUringSink(std::shared_ptr<VCDFdSink> file, unsigned depth) :
+    _file(std::move(file))
+{
+    if (!_file)
+        throw VCDException{ "Invalid pointer to file sink" };
+    _buffers.resize(std::max(depth, 1u));
+    // the writes are at the offsets, so not for pipes
+    if (depth && file_offset(_file->fd(), _offset))
+        _ring = Ring::open(depth);
+}
+
+// -----------------------------
+VCDUringSink::VCDUringSink(const std::string &filename, unsigned depth) :
+    VCDUringSink(std::make_shared<VCDFdSink>(filename), depth)
+{}
+
+// -----------------------------
+VCDUringSink::~VCDUringSink()
+{
+    try
+    { flush(); }
+    catch (const VCDException&)
+    {} // nothing to do in destructor
+}
+
+// -----------------------------
+void VCDUringSink::write(const char *data, size_t size)
+{
+    std::memcpy(acquire(size), data, size);
+    commit(size);
+}
+
+// -----------------------------
+char* VCDUringSink::acquire(size_t size)
+{
+    Buffer &buffer = _buffers[_current];
+    while (buffer.in_flight)
+        _reap(true);
+    if (buffer.capacity < size)
+    {
+        buffer.data.reset(new char[size]);
+        buffer.capacity = size;
+    }
+    return buffer.data.get();
+}
+
+// -----------------------------
+void VCDUringSink::commit(size_t size)
+{
+    if (!size)
+        return;
+    Buffer &buffer = _buffers[_current];
+    if (!_ring)
+    {
+        _file->write(buffer.data.get(), size);
+        _offset += size;
+        return;
+    }
+    buffer.offset = _offset;
+    buffer.size = size;
+    // the write is not submitted: by `pwrite(2)`, nothing is left in flight
+    if (!_ring->submit(_file->fd(), _current, buffer.data.get(), size, _offset))
+    {
+        pwrite_all(_file->fd(), buffer.data.get(), size, _offset);
+        _offset += size;
+        return;
+    }
+    buffer.in_flight = true;
+    _offset += size;
+    _current = (_current + 1u) % static_cast<unsigned>(_buffers.size());
+    _reap(false);
+}
+
+// -----------------------------
+void VCDUringSink::flush()
+{
+    while (std::any_of(_buffers.begin(), _buffers.end(), [](const Buffer &b) { return b.in_flight; }))
+        _reap(true);
+}
+
+// -----------------------------
+void VCDUringSink::close()
+{
+    flush();
+    _ring.reset();
+    _file->close();
+}
+
+// -----------------------------
+std::shared_ptr<VCDFdSink> VCDUringSink::detach()
+{
+    flush();
+    // `write(2)` goes on after the data
+    if (_ring && ::lseek(_file->fd(), static_cast<off_t>(_offset), SEEK_SET) < 0)
+        throw VCDException{ format("Cannot seek file: %s", std::strerror(errno)) };
+    _ring.reset();
+    return _file;
+}
+
+// -----------------------------
+// Complete the writes, the first error is thrown once all of them are reaped
+void VCDUringSink::_reap(bool wait)
+{
+    if (!_ring)
+        return;
+    _ring->reap(wait, [this](unsigned index, int res) {
+        Buffer &buffer = _buffers[index];
+        buffer.in_flight = false;
+        if (res < 0)
+        {
+            if (!_error)
+                _error = std::make_exception_ptr(VCDException{
+                    format("Cannot write into file: %s", std::strerror(-res)) });
+        }
+        else if (static_cast<size_t>(res) < buffer.size)
+        {
+            try
+            { pwrite_all(_file->fd(), buffer.data.get() + res, buffer.size - res, buffer.offset + res); }
+            catch (const VCDException&)
+            {
+                if (!_error)
+                    _error = std::current_exception();
+            }
+        }
+    });
+    if (_error && std::none_of(_buffers.begin(), _buffers.end(), [](const Buffer &b) { return b.in_flight; }))
+        std::rethrow_exception(std::exchange(_error, nullptr));
+}
+
+// -----------------------------
+}
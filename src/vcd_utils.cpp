@@ -1,5 +1,6 @@
 #include <array>
 #include <cstdarg>
+#include <cstdint>
 #include <cstring>
 #include <string>
 #include <vector>
@@ -43,11 +44,16 @@ std::string format(const char *fmt, ...)
 std::string now()
 {
     std::time_t rawtime = 0;
-    struct tm *timeinfo = nullptr;
+    struct tm timeinfo{};
     std::array<char, 80> buffer{};
     std::time(&rawtime);
-    timeinfo = std::localtime(&rawtime);
-    std::strftime(buffer.data(), buffer.size(), "%Y-%m-%d %H:%M:%S", timeinfo);
+    // std::localtime() shares a static buffer between threads
+#ifdef _WIN32
+    localtime_s(&timeinfo, &rawtime);
+#else
+    localtime_r(&rawtime, &timeinfo);
+#endif
+    std::strftime(buffer.data(), buffer.size(), "%Y-%m-%d %H:%M:%S", &timeinfo);
     return {buffer.data(), std::strlen(buffer.data())};
 }
 
@@ -80,6 +86,105 @@ void replace_new_lines(std::string &str, const std::string &sub)
 }
 
 // -----------------------------
+// File name of the segment *index*: `dump.vcd` of `0`, `dump_1.vcd` of `1`, etc.
+std::string segment_name(const std::string &filename, size_t index)
+{
+    if (!index)
+        return filename;
+    const size_t base = filename.find_last_of("/\\");
+    size_t dot = filename.find('.', base == std::string::npos ? 0 : base + 1);
+    if (dot == std::string::npos)
+        dot = filename.size();
+    return filename.substr(0, dot) + '_' + std::to_string(index) + filename.substr(dot);
 }
 
-   
\ No newline at end of file
+// -----------------------------
+// Binary digits of all bytes, MSB first
+struct BinaryDigits
+{
+    std::array<std::array<char, 8>, 256> digits{};
+
+    constexpr BinaryDigits()
+    {
+        for (unsigned b = 0; b < 256u; ++b)
+            for (unsigned i = 0; i < 8u; ++i)
+                digits[b][i] = char('0' + ((b >> (7u - i)) & 1u));
+    }
+};
+
+// -----------------------------
+// Write *nbits* (at most 64) lowest bits of *value* as binary digits, MSB first.
+// Return the end of written chars
+char* write_binary(char *out, uint64_t value, unsigned nbits)
+{
+    static constexpr BinaryDigits table;
+    for (; nbits % 8u; --nbits)
+        *out++ = char('0' + ((value >> (nbits - 1u)) & 1u));
+    for (; nbits; nbits -= 8u, out += 8)
+        std::memcpy(out, table.digits[(value >> (nbits - 8u)) & 0xFFu].data(), 8);
+    return out;
+}
+
+// -----------------------------
+// *value* fits into *size* bits as unsigned or, if *is_signed* and negative,
+// as two's complement (e.g. `-1` into one bit)
+bool fits_bits(uint64_t value, unsigned size, bool is_signed)
+{
+    if (size >= 64u)
+        return true;
+    const bool negative = is_signed && static_cast<int64_t>(value) < 0;
+    const uint64_t high = negative ? ~value : value;
+    return (high >> (size - (negative ? 1u : 0u))) == 0u;
+}
+
+// -----------------------------
+// Write decimal digits of *value*, two digits at a time.
+// Return the end of written chars
+char* write_decimal(char *out, uint64_t value)
+{
+    static constexpr char DIGITS[] =
+        "0001020304050607080910111213141516171819"
+        "2021222324252627282930313233343536373839"
+        "4041424344454647484950515253545556575859"
+        "6061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+    std::array<char, 20> buf{};
+    char *end = buf.data() + buf.size(), *p = end;
+    while (value >= 100u)
+    {
+        const auto i = static_cast<unsigned>(value % 100u) * 2u;
+        value /= 100u;
+        *--p = DIGITS[i + 1];
+        *--p = DIGITS[i];
+    }
+    if (value >= 10u)
+    {
+        const auto i = static_cast<unsigned>(value) * 2u;
+        *--p = DIGITS[i + 1];
+        *--p = DIGITS[i];
+    }
+    else
+        *--p = char('0' + value);
+
+    const auto n = static_cast<size_t>(end - p);
+    std::memcpy(out, p, n);
+    return out + n;
+}
+
+// -----------------------------
+// Identifier code of var *ident* in VCD: base-94 digits of printable
+// ASCII chars `!` to `~`, the least significant first
+std::string ident_code(unsigned ident)
+{
+    std::string code;
+    do
+    {
+        code.push_back(char('!' + ident % 94u));
+        ident /= 94u;
+    } while (ident);
+    return code;
+}
+
+// -----------------------------
+}
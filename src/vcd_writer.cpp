@@ -5,7 +5,9 @@
 #include <algorithm>
 #include <array>
 #include <list>
+#include <unordered_map>
 #include <utility>
+#include <fmt/compile.h>
 #include "vcd_writer.h"
 
 
@@ -13,6 +15,10 @@
 namespace vcd {
 namespace utils {
 void replace_new_lines(std::string &str, const std::string &sub);
+char* write_binary(char *out, uint64_t value, unsigned nbits);
+bool fits_bits(uint64_t value, unsigned size, bool is_signed);
+std::string ident_code(unsigned ident);
+std::string segment_name(const std::string &filename, size_t index);
 }
 using namespace utils;
 
@@ -68,21 +74,146 @@ HeadPtr makeVCDHeader(TimeScale timescale_quan, TimeScaleUnit timescale_unit, co
 void VCDHeaderDeleter::operator()(VCDHeader *p) { delete p; }
 
 // -----------------------------
+// Node of the tree of scopes: `a.b.c` is `c` in `b` in `a` in the root
 struct VCDScope final
 {
-    std::string name;
+    std::string name;  // full name, e.g. `a.b.c`
+    std::string part;  // the last component, e.g. `c`
     ScopeType   type;
     std::list<VarPtr> vars;
+    // subscopes by their `part` (the keys view it), in order of the header
+    std::unordered_map<std::string_view, ScopePtr> index;
+    std::vector<VCDScope*> children;
 
-    VCDScope(std::string_view name, ScopeType type) : 
-        name(name), type(type) {}
+    VCDScope(std::string_view name, ScopeType type, std::string_view part = {}) :
+        name(name), part(part), type(type) {}
 };
 
 // -----------------------------
-bool ScopePtrHash::operator()(const ScopePtr &l, const ScopePtr &r) const
+// Previous values of the registered variables, so that only actual changes
+// are dumped. 4-state bits are packed into 2 bits: value and unknown (`0 1 x z`
+// are `00 01 10 11`). Scalars are kept at their var ident, 32 per word.
+// Vectors have fixed-width slots of 2 planes (values, unknowns) of `words(size)`
+// each, the least significant bit first. Reals keep raw bits of a double.
+struct VCDValueStore final
 {
-    return (l->name < r->name);
-}
+    std::vector<uint64_t> scalars;  // 2 bits per scalar
+    std::vector<uint64_t> words;    // slots of vectors and reals
+    std::vector<VarValue> strings;  // slots of strings
+    unsigned count{};               // number of vars with values
+
+    //! number of words of one plane of a vector
+    static unsigned words_count(unsigned size) { return (size + 63u) / 64u; }
+    //! 4-state code of one of `VCDValues`
+    static uint64_t code(char c)
+    { return ((c | (c >> 1)) & 1u) | (((c >> 6) & 1u) << 1); }
+    //! one of `VCDValues` by 4-state code
+    static char value(uint64_t code)
+    {
+        static constexpr std::array<char, 4> VALUES{ VCDValues::ZERO, VCDValues::ONE, VCDValues::UNDEF, VCDValues::HIGHV };
+        return VALUES[code];
+    }
+
+    unsigned add_scalar(unsigned ident)
+    {
+        if (scalars.size() <= ident / 32u)
+            scalars.resize(ident / 32u + 1u);
+        return ident;
+    }
+    unsigned add_words(unsigned n)
+    {
+        words.resize(words.size() + n);
+        return static_cast<unsigned>(words.size() - n);
+    }
+    unsigned add_string()
+    {
+        strings.emplace_back();
+        return static_cast<unsigned>(strings.size() - 1u);
+    }
+
+    [[nodiscard]] uint64_t scalar(unsigned ident) const
+    { return (scalars[ident / 32u] >> ((ident % 32u) * 2u)) & 3u; }
+
+    //! Return *true* if the scalar was changed
+    bool update_scalar(unsigned ident, uint64_t code)
+    {
+        uint64_t &word = scalars[ident / 32u];
+        const unsigned shift = (ident % 32u) * 2u;
+        if (((word >> shift) & 3u) == code)
+            return false;
+        word = (word & ~(uint64_t(3u) << shift)) | (code << shift);
+        return true;
+    }
+
+    //! Return *true* if the vector was changed, *chars* are `VCDValues` the MSB first
+    bool update_vector(unsigned slot, unsigned size, const char *chars)
+    {
+        const unsigned n = words_count(size);
+        uint64_t *values = &words[slot], *unknowns = values + n;
+        bool changed = false;
+        for (unsigned w = 0; w < n; ++w)
+        {
+            uint64_t v = 0, u = 0;
+            for (unsigned bit = std::min(size, (w + 1u) * 64u); bit-- > w * 64u;)
+            {
+                const uint64_t c = code(chars[size - 1u - bit]);
+                v = (v << 1) | (c & 1u);
+                u = (u << 1) | (c >> 1);
+            }
+            changed |= (values[w] != v) | (unknowns[w] != u);
+            values[w] = v;
+            unknowns[w] = u;
+        }
+        return changed;
+    }
+
+    //! Return *true* if the vector was changed, *value* is sign-extended if *negative*
+    bool update_vector(unsigned slot, unsigned size, uint64_t value, bool negative)
+    {
+        const unsigned n = words_count(size);
+        const unsigned tail = size % 64u;
+        const uint64_t ext = negative ? ~uint64_t(0u) : 0u;
+        uint64_t *values = &words[slot], *unknowns = values + n;
+        bool changed = false;
+        for (unsigned w = 0; w < n; ++w)
+        {
+            uint64_t v = (w == 0) ? value : ext;
+            if (w == n - 1u && tail)
+                v &= (uint64_t(1u) << tail) - 1u;
+            changed |= (values[w] != v) | (unknowns[w] != 0u);
+            values[w] = v;
+            unknowns[w] = 0u;
+        }
+        return changed;
+    }
+
+    //! Return *true* if the *n* words of the slot were changed
+    bool update_words(unsigned slot, const uint64_t *src, unsigned n)
+    {
+        uint64_t *dst = &words[slot];
+        if (std::equal(src, src + n, dst))
+            return false;
+        std::copy(src, src + n, dst);
+        return true;
+    }
+
+    //! Return *true* if the real was changed
+    bool update_real(unsigned slot, double value)
+    {
+        uint64_t bits = 0;
+        std::memcpy(&bits, &value, sizeof(bits));
+        if (words[slot] == bits)
+            return false;
+        words[slot] = bits;
+        return true;
+    }
+    [[nodiscard]] double real(unsigned slot) const
+    {
+        double value = 0;
+        std::memcpy(&value, &words[slot], sizeof(value));
+        return value;
+    }
+};
 
 // -----------------------------
 // VCD variable details needed to call :meth:`VCDWriter.change()`.
@@ -103,10 +234,12 @@ public:
     VCDVariable& operator=(const VCDVariable&) = delete;
 
     unsigned    _ident;  // internal ID used in VCD output stream
+    std::string  _code;  // identifier code of ident in VCD output stream
     VariableType _type;  // VCD variable type, one of `VariableTypes`
     std::string  _name;  // human-readable name
     unsigned     _size;  // size of variable, in bits
     std::weak_ptr<VCDScope>    _scope;  // pointer to scope string
+    unsigned     _slot{};  // slot of previous value in `VCDValueStore`
 
     //! string representation of variable types
     static const std::array<std::string, 20> VAR_TYPES;
@@ -116,8 +249,24 @@ public:
 
     //! string representation of variable declartion in VCD
     [[nodiscard]] std::string declartion() const;
-    //! string representation of value change record in VCD
-    [[nodiscard]] virtual VarValue change_record(const VarValue &value) const = 0;
+    //! events are triggered and parameters are constant, only the others take changes
+    [[nodiscard]] bool changeable() const
+    { return _type != VariableType::event && _type != VariableType::parameter; }
+    //! allocate the slot of previous value in *store*
+    virtual void allocate(VCDValueStore &store) = 0;
+    //! if *value* differs from the previous one in *store*, update it there and
+    //! write value change record in VCD into *record*; return *true* if changed
+    virtual bool change(VCDValueStore &store, std::string_view value, VarValue &record) const = 0;
+    //! the same for the integer *value*
+    virtual bool change(VCDValueStore &store, uint64_t value, bool is_signed, VarValue &record) const = 0;
+    //! the same for the floating point *value*, real variables only
+    virtual bool change(VCDValueStore&, double value, VarValue&) const
+    { throw VCDTypeException{ format("Invalid real value for '%s': %g", _name.c_str(), value) }; }
+    //! write value change record in VCD of the previous value in *store* into *record*
+    virtual void record(const VCDValueStore &store, VarValue &record) const = 0;
+    //! copy the value from *from* into *to* (of the same layout); return *true* if it differed
+    virtual bool sync(const VCDValueStore&, VCDValueStore&) const
+    { return false; }
 
     friend class VCDWriter;
     friend struct VarPtrHash;
@@ -154,14 +303,35 @@ struct VCDScalarVariable : public VCDVariable
     VCDScalarVariable(const std::string &name, VariableType type, unsigned size, ScopePtr scope, unsigned next_var_id) :
         VCDVariable(name, type, size, std::move(scope), next_var_id)
     {}
-    [[nodiscard]] VarValue change_record(const VarValue &value) const override
+    void allocate(VCDValueStore &store) override
+    { _slot = store.add_scalar(_ident); }
+
+    bool change(VCDValueStore &store, std::string_view value, VarValue &record) const override
     {
         char c = (value.size())? char(tolower(value[0])) : char(VCDValues::UNDEF);
         if (value.size() != 1 || (c != VCDValues::ONE   && c != VCDValues::ZERO
                                && c != VCDValues::UNDEF && c != VCDValues::HIGHV))
             throw VCDTypeException{ format("Invalid scalar value '%c'", c) };
-        return {c};
+        if (!store.update_scalar(_slot, VCDValueStore::code(c)))
+            return false;
+        record.assign(1, c);
+        return true;
+    }
+    bool change(VCDValueStore &store, uint64_t value, bool is_signed, VarValue &record) const override
+    {
+        // the same fit as of a one-bit vector, `-1` is `1`
+        if (!fits_bits(value, 1u, is_signed))
+            throw VCDTypeException{ format("Invalid scalar value '%lld'", static_cast<long long>(value)) };
+        value &= 1u;
+        if (!store.update_scalar(_slot, value))
+            return false;
+        record.assign(1, char(VCDValues::ZERO + value));
+        return true;
     }
+    void record(const VCDValueStore &store, VarValue &record) const override
+    { record.assign(1, VCDValueStore::value(store.scalar(_slot))); }
+    bool sync(const VCDValueStore &from, VCDValueStore &to) const override
+    { return to.update_scalar(_slot, from.scalar(_slot)); }
 };
 
 // -----------------------------
@@ -172,11 +342,34 @@ struct VCDStringVariable : public VCDVariable
     VCDStringVariable(const std::string &name, VariableType type, unsigned size, ScopePtr scope, unsigned next_var_id) :
         VCDVariable(name, type, size, std::move(scope), next_var_id)
     {}
-    [[nodiscard]]VarValue change_record(const VarValue &value) const override
+    void allocate(VCDValueStore &store) override
+    { _slot = store.add_string(); }
+
+    bool change(VCDValueStore &store, std::string_view value, VarValue &record) const override
+    {
+        if (value.find(' ') != std::string_view::npos)
+            throw VCDTypeException{ format("Invalid string value '%.*s'", int(value.size()), value.data()) };
+        // the previous value keeps its capacity, no allocations once it is large enough
+        VarValue &prev = store.strings[_slot];
+        if (prev == value)
+            return false;
+        prev.assign(value.data(), value.size());
+        this->record(store, record);
+        return true;
+    }
+    bool change(VCDValueStore&, uint64_t value, bool, VarValue&) const override
+    { throw VCDTypeException{ format("Invalid string value '%llu'", static_cast<unsigned long long>(value)) }; }
+    void record(const VCDValueStore &store, VarValue &record) const override
     {
-        if (value.find(' ') != std::string::npos)
-            throw VCDTypeException{ format("Invalid string value '%s'", value.c_str()) };
-        return format("s%s ", value.c_str());
+        const VarValue &value = store.strings[_slot];
+        record.assign(1, 's').append(value).push_back(' ');
+    }
+    bool sync(const VCDValueStore &from, VCDValueStore &to) const override
+    {
+        if (to.strings[_slot] == from.strings[_slot])
+            return false;
+        to.strings[_slot].assign(from.strings[_slot]);
+        return true;
     }
 };
 
@@ -187,8 +380,39 @@ struct VCDRealVariable : public VCDVariable
 {
     VCDRealVariable(const std::string &name, VariableType type, unsigned size, ScopePtr scope, unsigned next_var_id) :
         VCDVariable(name, type, size, std::move(scope), next_var_id) {}
-    [[nodiscard]]std::string change_record(const VarValue &value) const override
-    { return format("r%.16g ", stod(value)); }
+    void allocate(VCDValueStore &store) override
+    { _slot = store.add_words(1u); }
+
+    bool change(VCDValueStore &store, std::string_view value, VarValue &record) const override
+    {
+        // *record* is a scratch for the null-terminated copy of *value*
+        record.assign(value.data(), value.size());
+        if (!store.update_real(_slot, stod(record)))
+            return false;
+        this->record(store, record);
+        return true;
+    }
+    bool change(VCDValueStore &store, uint64_t value, bool is_signed, VarValue &record) const override
+    {
+        double d = is_signed ? double(static_cast<int64_t>(value)) : double(value);
+        return change(store, d, record);
+    }
+    bool change(VCDValueStore &store, double value, VarValue &record) const override
+    {
+        if (!store.update_real(_slot, value))
+            return false;
+        this->record(store, record);
+        return true;
+    }
+    //! the shortest representation which reads back to the same double
+    void record(const VCDValueStore &store, VarValue &record) const override
+    {
+        char buf[32];
+        char *end = fmt::format_to(buf, FMT_COMPILE("{}"), store.real(_slot));
+        record.assign(1, 'r').append(buf, end).push_back(' ');
+    }
+    bool sync(const VCDValueStore &from, VCDValueStore &to) const override
+    { return to.update_words(_slot, &from.words[_slot], 1u); }
 };
 
 // -----------------------------
@@ -198,7 +422,61 @@ struct VCDVectorVariable : public VCDVariable
 {
     VCDVectorVariable(const std::string &name, VariableType type, unsigned size, ScopePtr scope, unsigned next_var_id) :
         VCDVariable(name, type, size, std::move(scope), next_var_id) {}
-    [[nodiscard]]std::string change_record(const VarValue &value) const override;
+    void allocate(VCDValueStore &store) override
+    { _slot = store.add_words(2u * VCDValueStore::words_count(_size)); }
+
+    bool change(VCDValueStore &store, std::string_view value, VarValue &record) const override
+    {
+        change_record(value, record);
+        return store.update_vector(_slot, _size, record.data() + 1);
+    }
+    bool change(VCDValueStore &store, uint64_t value, bool is_signed, VarValue &record) const override;
+    void record(const VCDValueStore &store, VarValue &record) const override;
+    bool sync(const VCDValueStore &from, VCDValueStore &to) const override
+    { return to.update_words(_slot, &from.words[_slot], 2u * VCDValueStore::words_count(_size)); }
+
+    //! string representation of value change record in VCD (written into *record*)
+    void change_record(std::string_view value, VarValue &record) const;
+};
+
+// -----------------------------
+// Parameter is a constant vector: its value is rendered once on registration,
+// dumped by `$dumpvars` and takes no slot in `VCDValueStore`
+struct VCDParameterVariable : public VCDVectorVariable
+{
+    VCDParameterVariable(const std::string &name, VariableType type, unsigned size, ScopePtr scope, unsigned next_var_id,
+                         std::string_view value) :
+        VCDVectorVariable(name, type, size, std::move(scope), next_var_id)
+    { change_record(value, _value); }
+    void allocate(VCDValueStore&) override
+    {}
+
+    bool change(VCDValueStore&, std::string_view, VarValue&) const override
+    { throw VCDTypeException{ format("Cannot change parameter '%s'", _name.c_str()) }; }
+    bool change(VCDValueStore&, uint64_t, bool, VarValue&) const override
+    { throw VCDTypeException{ format("Cannot change parameter '%s'", _name.c_str()) }; }
+    void record(const VCDValueStore&, VarValue &record) const override
+    { record = _value; }
+
+private:
+    VarValue _value;
+};
+
+// -----------------------------
+// Event has no value, it is only triggered (`1` dumped) at some timestamps
+struct VCDEventVariable : public VCDVariable
+{
+    VCDEventVariable(const std::string &name, VariableType type, unsigned size, ScopePtr scope, unsigned next_var_id) :
+        VCDVariable(name, type, size, std::move(scope), next_var_id) {}
+    void allocate(VCDValueStore&) override
+    {}
+
+    bool change(VCDValueStore&, std::string_view, VarValue&) const override
+    { throw VCDTypeException{ format("Cannot change event '%s', use trigger()", _name.c_str()) }; }
+    bool change(VCDValueStore&, uint64_t, bool, VarValue&) const override
+    { throw VCDTypeException{ format("Cannot change event '%s', use trigger()", _name.c_str()) }; }
+    void record(const VCDValueStore&, VarValue &record) const override
+    { record.assign(1, VCDValues::ONE); }
 };
 
 // -----------------------------
@@ -220,16 +498,35 @@ VCDWriter::VCDWriter(std::string filename, HeadPtr &header, unsigned init_timest
     _scope_sep("."),
     _scope_def_type(ScopeType::module),
     _filename(std::move(filename)),
+    _ofile(_filename),
+    _scopes(std::make_shared<VCDScope>("", ScopeType::module)),
     _dumping(true),
     _registering(true),
     _search(std::make_shared<VarSearch>(_scope_def_type)),
-    _ofile(fmt::output_file(_filename))
+    _values(std::make_shared<VCDValueStore>())
 {
     if (!_header)
         throw VCDTypeException{ "Invalid pointer to header" };
     
 }
 
+// -----------------------------
+VCDWriter::VCDWriter(SinkPtr sink, HeadPtr &header, unsigned init_timestamp) :
+    _timestamp(init_timestamp),
+    _header((header) ? std::move(header) : makeVCDHeader()),
+    _scope_sep("."),
+    _scope_def_type(ScopeType::module),
+    _ofile(std::move(sink)),
+    _scopes(std::make_shared<VCDScope>("", ScopeType::module)),
+    _dumping(true),
+    _registering(true),
+    _search(std::make_shared<VarSearch>(_scope_def_type)),
+    _values(std::make_shared<VCDValueStore>())
+{
+    if (!_header)
+        throw VCDTypeException{ "Invalid pointer to header" };
+}
+
 // -----------------------------
 VarPtr VCDWriter::register_var(const std::string &scope, const std::string &name, VariableType type,
                                unsigned size, const VarValue &init, bool duplicate_names_check)
@@ -243,14 +540,35 @@ VarPtr VCDWriter::register_var(const std::string &scope, const std::string &name
     if (scope.size() == 0 || name.size() == 0)
         throw VCDTypeException{ format("Empty scope '%s' or name '%s'", scope.c_str(), name.c_str()) };
 
-    _search->vcd_scope.name = scope;
-    auto cur_scope = _scopes.find(_search->ptr_scope);
-    if (cur_scope == _scopes.end())
+    // down the tree by the components of the scope, one lookup each; no unnamed scopes
+    // by the empty components, e.g. `top.` or `a..b`, the scopes created so far are dropped
+    const ScopePtr *cur_scope = &_scopes;
+    VCDScope *created_in = nullptr;  // the parent of the first created scope
+    for (size_t beg = 0, end = 0; end != scope.size(); beg = end + _scope_sep.size())
     {
-        auto res = _scopes.insert(std::make_shared<VCDScope>(scope, _scope_def_type));
-        if (!res.second)
-            throw VCDPhaseException{ format("Cannot insert scope '%s'", scope.c_str()) };
-        cur_scope = res.first;
+        end = std::min(scope.find(_scope_sep, beg), scope.size());
+        if (end == beg)
+        {
+            if (created_in)
+            {
+                const auto first = created_in->index.find(created_in->children.back()->part);
+                created_in->children.pop_back();
+                created_in->index.erase(first);
+            }
+            throw VCDTypeException{ format("Empty component of scope '%s'", scope.c_str()) };
+        }
+        const std::string_view part{ scope.data() + beg, end - beg };
+        VCDScope &parent = **cur_scope;
+        auto it = parent.index.find(part);
+        if (it == parent.index.end())
+        {
+            auto child = std::make_shared<VCDScope>(std::string_view{ scope.data(), end }, _scope_def_type, part);
+            parent.children.push_back(child.get());
+            it = parent.index.emplace(child->part, std::move(child)).first;
+            if (!created_in)
+                created_in = &parent;
+        }
+        cur_scope = &it->second;
     }
 
     auto sz = [&size](unsigned def) { return (size ? size : def);  };
@@ -277,7 +595,7 @@ VarPtr VCDWriter::register_var(const std::string &scope, const std::string &name
             break;
 
         case VariableType::event:
-            pvar = VarPtr(new VCDScalarVariable(name, type, 1, *cur_scope, _next_var_id));
+            pvar = VarPtr(new VCDEventVariable(name, type, 1, *cur_scope, _next_var_id));
             break;
 
         default:
@@ -285,18 +603,28 @@ VarPtr VCDWriter::register_var(const std::string &scope, const std::string &name
                 throw VCDTypeException{ format("Must supply size for type '%s' of var '%s'",
                                                VCDVariable::VAR_TYPES[(int)type].c_str(), name.c_str()) };
 
-            pvar = VarPtr(new VCDVectorVariable(name, type, size, *cur_scope, _next_var_id));
             if (init_value.size() == 1 && init_value[0] == VCDValues::UNDEF)
                 init_value = std::string(size, VCDValues::UNDEF);
+            if (type == VariableType::parameter)
+                pvar = VarPtr(new VCDParameterVariable(name, type, size, *cur_scope, _next_var_id, init_value));
+            else
+                pvar = VarPtr(new VCDVectorVariable(name, type, size, *cur_scope, _next_var_id));
             break;
     }     
-    if (type != VariableType::event)
-        _change(pvar, _timestamp, init_value, true);
-    
     if (duplicate_names_check && _vars.find(pvar) != _vars.end())
         throw VCDTypeException{ format("Duplicate var '%s' in scope '%s'", name.c_str(), scope.c_str()) };
 
+    if (pvar->changeable())
+    {
+        pvar->allocate(*_values);
+        pvar->change(*_values, init_value, _record);
+    }
+    if (type != VariableType::event)
+        _values->count++;
+
     _vars.insert(pvar);
+    _vars_idents.push_back(pvar.get());
+    _captured.push_back(true);
     (**cur_scope).vars.push_back(pvar);
     // Only alter state after change_func() succeeds
     _next_var_id++;
@@ -304,51 +632,298 @@ VarPtr VCDWriter::register_var(const std::string &scope, const std::string &name
 }
 
 // -----------------------------
-bool VCDWriter::_change(VarPtr var, TimeStamp timestamp, const VarValue &value, bool reg)
+bool VCDWriter::_change(VCDVariable &var, TimeStamp timestamp, std::string_view value)
+{
+    _change_timestamp(var, timestamp);
+    if (!var.change(*_values, value, _record))
+        return false;
+    _change_record(var);
+    return true;
+}
+
+// -----------------------------
+bool VCDWriter::_change(VCDVariable &var, TimeStamp timestamp, uint64_t value, bool is_signed)
+{
+    _change_timestamp(var, timestamp);
+    if (!var.change(*_values, value, is_signed, _record))
+        return false;
+    _change_record(var);
+    return true;
+}
+
+// -----------------------------
+bool VCDWriter::_change(VCDVariable &var, TimeStamp timestamp, double value)
+{
+    _change_timestamp(var, timestamp);
+    if (!var.change(*_values, value, _record))
+        return false;
+    _change_record(var);
+    return true;
+}
+
+// -----------------------------
+size_t VCDWriter::change_batch(TimeStamp timestamp, const VarChange *changes, size_t count)
+{
+    if (!count)
+        return 0;
+    _change_timestamp(_var(changes[0].var), timestamp);
+
+    // by handle to walk the previous values sequentially, the changes of the same
+    // var in given order; an unsorted batch is sorted by pointers to its changes
+    auto by_handle = [](const VarChange *a, const VarChange *b)
+    { return a->var.ident < b->var.ident || (a->var.ident == b->var.ident && a < b); };
+    _batch.clear();
+    for (size_t i = 0; i < count; ++i)
+        _batch.push_back(changes + i);
+    if (!std::is_sorted(_batch.begin(), _batch.end(), by_handle))
+        std::sort(_batch.begin(), _batch.end(), by_handle);
+
+    size_t dumped = 0;
+    for (const VarChange *c : _batch)
+    {
+        VCDVariable &var = _var(c->var);
+        if (!var.changeable())
+            throw VCDTypeException{ format("Cannot change %s '%s'", VCDVariable::VAR_TYPES[int(var._type)].c_str(),
+                                           var._name.c_str()) };
+        if (var.change(*_values, c->value, false, _record))
+        {
+            _change_record(var);
+            ++dumped;
+        }
+    }
+    return dumped;
+}
+
+// -----------------------------
+VCDChannel::VCDChannel(size_t capacity)
+{
+    size_t n = 2u;
+    while (n < capacity)
+        n <<= 1u;
+    _ring.reset(new Record[n]);
+    _mask = n - 1u;
+}
+
+// -----------------------------
+ChannelPtr VCDWriter::channel(size_t capacity)
+{
+    if (_closed)
+        throw VCDPhaseException{ "Cannot open channel after close()" };
+    _channels.push_back(std::make_shared<VCDChannel>(capacity));
+    return _channels.back();
+}
+
+// -----------------------------
+size_t VCDWriter::_drain(bool all)
+{
+    // the epochs first: the changes before them are published already
+    uint64_t epoch = VCDChannel::closed_epoch;
+    if (!all)
+        for (const auto &c : _channels)
+            epoch = std::min(epoch, c->_epoch.load(std::memory_order_acquire));
+
+    _drained.resize(_channels.size());
+    for (size_t i = 0; i < _channels.size(); ++i)
+        _drained[i] = _channels[i]->_head_pub.load(std::memory_order_acquire);
+
+    size_t dumped = 0;
+    while (true)
+    {
+        // the next timestamp of all channels
+        uint64_t timestamp = VCDChannel::closed_epoch;
+        for (size_t i = 0; i < _channels.size(); ++i)
+        {
+            const VCDChannel &c = *_channels[i];
+            if (c._read != _drained[i])
+                timestamp = std::min<uint64_t>(timestamp, c._ring[c._read & c._mask].timestamp);
+        }
+        if (timestamp >= epoch)
+            break;
+
+        for (size_t i = 0; i < _channels.size(); ++i)
+        {
+            VCDChannel &c = *_channels[i];
+            while (c._read != _drained[i] && c._ring[c._read & c._mask].timestamp == timestamp)
+            {
+                const VCDChannel::Record &r = c._ring[c._read++ & c._mask];
+                _change(_var(r.var), r.timestamp, r.value, false);
+                ++dumped;
+            }
+            c._tail.store(c._read, std::memory_order_release);
+        }
+    }
+    return dumped;
+}
+
+// -----------------------------
+void VCDWriter::_change_timestamp(const VCDVariable &var, TimeStamp timestamp)
 {
     if (timestamp < _timestamp)
-        throw VCDPhaseException{ format("Out of order value change var '%s'", var->_name.c_str()) };
+        throw VCDPhaseException{ format("Out of order value change var '%s'", var._name.c_str()) };
     else if (_closed)
         throw VCDPhaseException{ "Cannot change value after close()" };
 
-    if (!var)
-        throw VCDTypeException{ "Invalid VCDVariable" };
+    if (!var.changeable())
+        throw VCDTypeException{ format("Cannot change %s '%s'", VCDVariable::VAR_TYPES[int(var._type)].c_str(),
+                                       var._name.c_str()) };
+    _set_timestamp(timestamp);
+}
 
+// -----------------------------
+void VCDWriter::_set_timestamp(TimeStamp timestamp)
+{
     if (timestamp > _timestamp)
     {
         if (_registering)
             _finalize_registration();
-        if (_dumping)
-            _ofile.print("#{:d}\n", timestamp);
+        if (_coalesce)
+            _dump_step();
+        if (_segment_sink && _segment_full(timestamp))
+        {
+            // the next segment starts with `#timestamp`
+            _next_segment(timestamp);
+            _timestamp_due = false;
+        }
+        else if (_recorder_out && _slice_full(timestamp))
+        {
+            // `#timestamp` of the slice is dumped along with it
+            _next_slice(timestamp);
+            _timestamp_due = false;
+        }
+        // `#timestamp` is dumped along with the first change record
+        else if (_coalesce)
+            _timestamp_due = _dumping;
+        else
+        {
+            _timestamp_due = false;
+            if (_dumping)
+                _ofile.timestamp(timestamp);
+        }
         _timestamp = timestamp;
     }
+}
 
-    VarValue change_value = var->change_record(value);
-    // if value changed
-    auto it = _vars_prevs.find(var);
-    if (it != _vars_prevs.end())
+// -----------------------------
+void VCDWriter::_trigger(const VCDVariable &var, TimeStamp timestamp)
+{
+    if (timestamp < _timestamp)
+        throw VCDPhaseException{ format("Out of order trigger of event '%s'", var._name.c_str()) };
+    else if (_closed)
+        throw VCDPhaseException{ "Cannot trigger event after close()" };
+    if (var._type != VariableType::event)
+        throw VCDTypeException{ format("Cannot trigger var '%s', it is not an event", var._name.c_str()) };
+
+    _set_timestamp(timestamp);
+    // an event has no value in `$dumpvars`, so it is dumped after the header anyway
+    if (_registering)
+        _finalize_registration();
+    if (_dumping && _captured[var._ident])
     {
-        if (it->second == change_value)
-            return false;
-        it->second = change_value;
+        _dump_timestamp();
+        _ofile.put(VCDValues::ONE);
+        _ofile.append(var._code);
+        _ofile.put('\n');
     }
-    else
+}
+
+// -----------------------------
+VCDVariable& VCDWriter::_var(const VarPtr &var) const
+{
+    if (!var)
+        throw VCDTypeException{ "Invalid VCDVariable" };
+    if (var->_ident >= _vars_idents.size() || _vars_idents[var->_ident] != var.get())
+        throw VCDTypeException{ format("VCDVariable '%s' do not registered", var->_name.c_str()) };
+    return *var;
+}
+
+// -----------------------------
+VarHandle VCDWriter::handle(const VarPtr &var) const
+{
+    return VarHandle{ _var(var)._ident };
+}
+
+// -----------------------------
+void VCDWriter::_change_record(const VCDVariable &var)
+{
+    if (_registering)
+        return;
+    if (_coalesce)
     {
-        if (!reg)
-            throw VCDTypeException{ format("VCDVariable '%s' do not registered", var->_name.c_str()) };
-        else
-            _vars_prevs.emplace(var, change_value);
+        // keep the last record of the timestamp, it is dumped when the timestamp advances
+        if (!_step_dirty[var._ident])
+        {
+            _step_dirty[var._ident] = true;
+            _step_changes.push_back(var._ident);
+        }
+        _step_records[var._ident].assign(_record);
+        return;
     }
     // dump it into file
-    if (_dumping && !_registering)
-        _ofile.print("{:s}{:x}\n", change_value.c_str(), var->_ident);
-    return true;
+    if (_dumping && _captured[var._ident])
+    {
+        _ofile.append(_record);
+        _ofile.append(var._code);
+        _ofile.put('\n');
+    }
+}
+
+// -----------------------------
+void VCDWriter::set_coalesce(bool coalesce)
+{
+    if (coalesce == _coalesce)
+        return;
+    if (_coalesce)
+    {
+        _dump_step();
+        _dump_timestamp();
+    }
+    _coalesce = coalesce;
+    _timestamp_due = false;
+    if (_coalesce && !_registering)
+        _start_coalescing();
+}
+
+// -----------------------------
+void VCDWriter::_start_coalescing()
+{
+    _step_values = std::make_shared<VCDValueStore>(*_values);
+    _step_records.resize(_vars_idents.size());
+    _step_dirty.assign(_vars_idents.size(), false);
+    _step_changes.clear();
+}
+
+// -----------------------------
+void VCDWriter::_dump_timestamp()
+{
+    if (!_timestamp_due)
+        return;
+    _ofile.timestamp(_timestamp);
+    _timestamp_due = false;
+}
+
+// -----------------------------
+void VCDWriter::_dump_step()
+{
+    // the vars changed back to the values of the step start are skipped,
+    // the others are synced with the step values (silently if not dumping)
+    for (const unsigned ident : _step_changes)
+    {
+        const VCDVariable &var = *_vars_idents[ident];
+        _step_dirty[ident] = false;
+        if (!var.sync(*_values, *_step_values) || !_dumping || !_captured[ident])
+            continue;
+        _dump_timestamp();
+        _ofile.append(_step_records[ident]);
+        _ofile.append(var._code);
+        _ofile.put('\n');
+    }
+    _step_changes.clear();
 }
 
 // -----------------------------
 bool VCDWriter::change(const std::string &scope, const std::string &name, TimeStamp timestamp, const VarValue &value)
 {
-    return _change(var(scope, name), timestamp, value, false);
+    return _change(_var(var(scope, name)), timestamp, value);
 }
 
 // -----------------------------
@@ -366,61 +941,145 @@ VarPtr VCDWriter::var(const std::string &scope, const std::string &name) const
 // -----------------------------
 void VCDWriter::set_scope_type(std::string &scope, ScopeType scope_type)
 {
-    // The _search is a speed optimisation
-    _search->vcd_scope.name = scope;
-    auto it = _scopes.find(_search->ptr_scope);
-    if (it == _scopes.end())
+    VCDScope *found = _find_scope(scope);
+    if (!found)
         throw VCDPhaseException{ format("Such scope '%s' does not exist", scope.c_str()) };
-    (**it).type = scope_type;
+    found->type = scope_type;
+}
+
+// -----------------------------
+VCDScope* VCDWriter::_find_scope(const std::string &scope) const
+{
+    VCDScope *cur_scope = _scopes.get();
+    for (size_t beg = 0, end = 0; end != scope.size(); beg = end + _scope_sep.size())
+    {
+        end = std::min(scope.find(_scope_sep, beg), scope.size());
+        auto it = cur_scope->index.find(std::string_view{ scope.data() + beg, end - beg });
+        if (it == cur_scope->index.end())
+            return nullptr;
+        cur_scope = it->second.get();
+    }
+    return scope.empty() ? nullptr : cur_scope;
 }
 
 
 // -----------------------------
 void VCDWriter::_dump_off(TimeStamp timestamp)
 {
-    _ofile.print("#{:d}\n", timestamp);
-    _ofile.print("$dumpoff\n");
-    for (const auto &p : _vars_prevs)
+    _ofile.timestamp(timestamp);
+    _ofile.append("$dumpoff\n");
+    for (const auto *var : _vars_idents)
     {
-        const auto ident = p.first->_ident;
-        const char *value = p.second.c_str();
+        if (var->_type != VariableType::event)
+            _dump_unknown(*var);
+    }
+    _ofile.append("$end\n");
+}
 
-        if (value[0] == 'r')
-        {} // real variables cannot have "z" or "x" state
-        else if (value[0] == 'b')
-        { _ofile.print("bx {:x}\n", ident); }
-        //else if (value[0] == 's')
-        //{ _ofile.print("sx %x\n", ident); }
-        else
-        { _ofile.print("x{:x}\n", ident); }
+// -----------------------------
+void VCDWriter::_dump_unknown(const VCDVariable &var)
+{
+    const auto &ident = var._code;
+    switch (var._type)
+    {
+        case VariableType::event:
+            break;
+        // real and string variables have no "x" state: NaN and the string "x" stand for it
+        case VariableType::real:
+            _ofile.print("rnan {:s}\n", ident);
+            break;
+        case VariableType::string:
+            _ofile.print("sx {:s}\n", ident);
+            break;
+        // the one-bit ones are scalars, as in `register_var()`
+        case VariableType::integer:
+        case VariableType::realtime:
+            if (var._size == 1)
+            {
+                _ofile.print("x{:s}\n", ident);
+                break;
+            }
+            [[fallthrough]];
+        default:
+            _ofile.print("bx {:s}\n", ident);
+            break;
     }
-    _ofile.print("$end\n");
 }
 
 // -----------------------------
-void VCDWriter::_dump_values(const char *keyword)
+void VCDWriter::dump_scope(const std::string &scope, bool enable, const TimeStamp *timestamp)
 {
-    _ofile.print("{:s}\n", keyword);
-    if(!_dumping)
-        return;
-    // TODO : events should be excluded
-    for (const auto &p : _vars_prevs)
+    if (_closed)
+        throw VCDPhaseException{ "Cannot dump_scope() after close()" };
+    if (timestamp != nullptr)
     {
-        const auto ident = p.first->_ident;
-        const char *value = p.second.c_str();
-        _ofile.print("{:s}{:x}\n", value, ident);
+        if (*timestamp < _timestamp)
+            throw VCDPhaseException{ format("Out of order dump_scope() of scope '%s'", scope.c_str()) };
+        _set_timestamp(*timestamp);
+    }
+
+    VCDScope *found = _find_scope(scope);
+    if (!found)
+        throw VCDPhaseException{ format("Such scope '%s' does not exist", scope.c_str()) };
+    // the scope and its subscopes
+    std::vector<const VCDScope*> stack{ found };
+    while (!stack.empty())
+    {
+        const VCDScope &cur = *stack.back();
+        stack.pop_back();
+        stack.insert(stack.end(), cur.children.begin(), cur.children.end());
+        for (const auto &var : cur.vars)
+        {
+            if (_captured[var->_ident] == enable)
+                continue;
+            _captured[var->_ident] = enable;
+            // the values of the header are dumped by `$dumpvars`
+            if (_registering || !_dumping || var->_type == VariableType::event)
+                continue;
+            _dump_timestamp();
+            // coalescing mode: the pending change of the step is taken over by this record
+            if (_coalesce)
+                var->sync(*_values, *_step_values);
+            if (!enable)
+                _dump_unknown(*var);
+            else
+            {
+                var->record(*_values, _record);
+                _ofile.append(_record);
+                _ofile.append(var->_code);
+                _ofile.put('\n');
+            }
+        }
     }
-    _ofile.print("$end\n");
 }
 
 // -----------------------------
-void VCDWriter::_scope_declaration(const std::string &scope, ScopeType type, size_t sub_beg, size_t sub_end)
+void VCDWriter::_dump_values(const char *keyword)
 {
-    const std::array<std::string, 5> SCOPE_TYPES = { "begin", "fork", "function", "module", "task" };
+    if (!_dumping)
+        return _ofile.print("{:s}\n", keyword);
+    _dump_values(keyword, *_values);
+}
 
-    auto scope_name = scope.substr(sub_beg, sub_end - sub_beg);
-    auto scope_type = SCOPE_TYPES[int(type)].c_str();
-    _ofile.print("$scope {:s} {:s} $end\n", scope_type, scope_name.c_str());
+// -----------------------------
+void VCDWriter::_dump_values(const char *keyword, const VCDValueStore &values)
+{
+    _ofile.print("{:s}\n", keyword);
+    for (const auto *var : _vars_idents)
+    {
+        if (var->_type == VariableType::event)
+            continue;
+        if (!_captured[var->_ident])
+        {
+            _dump_unknown(*var);
+            continue;
+        }
+        var->record(values, _record);
+        _ofile.append(_record);
+        _ofile.append(var->_code);
+        _ofile.put('\n');
+    }
+    _ofile.append("$end\n");
 }
 
 // -----------------------------
@@ -436,163 +1095,254 @@ void VCDWriter::_write_header()
         _ofile.print("{:s} {:s} $end\n", kwname, kwvalue.c_str());
     }
 
-    // nested scope
-    size_t n = 0, n_prev = 0;
-    std::string scope_prev = "";
-    for (auto& s : _scopes) // sorted
+    // the tree of scopes depth first, the vars of a scope before its subscopes
+    static const std::array<const char*, 5> SCOPE_TYPES = { "begin", "fork", "function", "module", "task" };
+    std::vector<std::pair<VCDScope*, size_t>> stack{ { _scopes.get(), 0 } };
+    while (!stack.empty())
     {
-        const std::string &scope = s->name;
-        // scope print close
-        if (scope_prev.size())
+        auto &[scope, next] = stack.back();
+        if (next == scope->children.size())
         {
-            n_prev = 0;
-            n = scope_prev.find(_scope_sep);
-            n = (n == std::string::npos) ? scope_prev.size() : n;
-            // equal prefix
-            while (std::strncmp(scope.c_str(), scope_prev.c_str(), n) == 0)
-            {
-                n_prev = n + _scope_sep.size();
-                n = scope_prev.find(_scope_sep, n_prev);
-                if (n == std::string::npos)
-                    break;
-            }
-            // last
-            if (n_prev != (scope_prev.size() + _scope_sep.size()))
-                _ofile.print("$upscope $end\n");
-            // close
-            n = scope_prev.find(_scope_sep, n_prev);
-            while (n != std::string::npos)
-            {
+            stack.pop_back();
+            if (!stack.empty())
                 _ofile.print("$upscope $end\n");
-                n = scope_prev.find(_scope_sep, n + _scope_sep.size());
-            }
+            continue;
         }
-
-        // scope print open
-        n = scope.find(_scope_sep, n_prev);
-        while (n != std::string::npos)
+        if (next == 0)
+            std::sort(scope->children.begin(), scope->children.end(),
+                      [](const VCDScope *a, const VCDScope *b) { return a->part < b->part; });
+        VCDScope *child = scope->children[next++];
+        _ofile.print("$scope {:s} {:s} $end\n", SCOPE_TYPES[int(child->type)], child->part);
+        for (const auto &var : child->vars)
         {
-            _scope_declaration(scope, s->type, n_prev, n);
-            n_prev = n + _scope_sep.size();
-            n = scope.find(_scope_sep, n_prev);
-        }
-        // last
-        _scope_declaration(scope, s->type, n_prev);
-
-        // dump variable declartion
-        for (const auto& var : s->vars)
-            _ofile.print("{:s}\n", var->declartion().c_str());
-
-        scope_prev = scope;
-    }
-
-    // scope print close (rest)
-    if (scope_prev.size())
-    {
-        // last
-        _ofile.print("$upscope $end\n");
-        n = scope_prev.find(_scope_sep);
-        while (n != std::string::npos)
-        {
-            _ofile.print("$upscope $end\n");
-            n = scope_prev.find(_scope_sep, n + _scope_sep.size());
+            _ofile.append(var->declartion());
+            _ofile.put('\n');
         }
+        stack.emplace_back(child, 0);
     }
 
     _ofile.print("$enddefinitions $end\n");
-    // do not need anymore
-    _header.reset(nullptr);
 }
 
 // -----------------------------
 void VCDWriter::_finalize_registration()
 {
     assert(_registering);
+    if (_recorder_out)
+        _next_slice(_timestamp);
+    else
+        _dump_start();
+    _segment_begin = _timestamp;
+    _registering = false;
+    if (_coalesce)
+        _start_coalescing();
+}
+
+// -----------------------------
+void VCDWriter::_dump_start()
+{
     _write_header();
-    if (_vars_prevs.size())
+    if (_has_values())
     {
-        _ofile.print("#{:d}\n", _timestamp);
+        _ofile.timestamp(_timestamp);
         _dump_values("$dumpvars");
         if (!_dumping)
             _dump_off(_timestamp);
     }
-    _registering = false;
+    // no values (events only): `#timestamp` is dumped along with the first trigger
+    else
+        _timestamp_due = _dumping;
+}
+
+// -----------------------------
+void VCDWriter::set_segments(uint64_t max_bytes, TimeStamp max_time, SinkFactory factory)
+{
+    if (_recorder_out)
+        throw VCDException{ "Cannot roll over segments of flight recorder" };
+    if (_filename.empty())
+        throw VCDException{ "Segments are named by the file name, the writer has none" };
+    _segment_bytes = max_bytes;
+    _segment_time = max_time;
+    _segment_sink = factory ? std::move(factory)
+                            : [](const std::string &filename) { return std::make_shared<VCDFdSink>(filename); };
+}
+
+// -----------------------------
+// Roll over to the next segment at *timestamp*, e.g. from `dump.vcd` to `dump_1.vcd`
+void VCDWriter::_next_segment(TimeStamp timestamp)
+{
+    const size_t index = _segments.size();
+    _segments.push_back(format("%s\t%llu\t%llu\n", segment_name(_filename, index).c_str(),
+                               static_cast<unsigned long long>(_segment_begin),
+                               static_cast<unsigned long long>(_timestamp)));
+    _ofile.reopen(_segment_sink(segment_name(_filename, index + 1)));
+    _timestamp = timestamp;
+    _segment_begin = timestamp;
+    _dump_start();
+    if (!_has_values() && _dumping)
+        _ofile.timestamp(timestamp);
+    _write_manifest(timestamp);
+}
+
+// -----------------------------
+void VCDWriter::set_flight_recorder(uint64_t max_bytes, TimeStamp max_time)
+{
+    if (!_registering)
+        throw VCDPhaseException{ "Cannot start flight recorder after the header is written" };
+    if (_segment_sink)
+        throw VCDException{ "Cannot roll over segments of flight recorder" };
+    if (!max_bytes && !max_time)
+        throw VCDException{ "Flight recorder needs a limit of bytes or time" };
+    _recorder_bytes = max_bytes;
+    _recorder_time = max_time;
+    // the output is put aside till `dump_recorder()`
+    if (!_recorder_out)
+        _recorder_out = _ofile.replace_sink(std::make_shared<VCDMemorySink>());
+}
+
+// -----------------------------
+// Start the slice of the changes at *timestamp* with the snapshot of the values,
+// drop the oldest slices out of the limits
+void VCDWriter::_next_slice(TimeStamp timestamp)
+{
+    auto changes = std::make_shared<VCDMemorySink>();
+    _ofile.replace_sink(changes);
+    uint64_t bytes = 0;
+    for (const auto &slice : _slices)
+        bytes += slice.changes->data().size();
+    size_t drop = 0;
+    for (; drop < _slices.size(); ++drop)
+    {
+        const bool over_bytes = _recorder_bytes && bytes > _recorder_bytes;
+        const bool over_time = _recorder_time && drop + 1u < _slices.size() &&
+                               timestamp - _slices[drop + 1u].begin >= _recorder_time;
+        if (!over_bytes && !over_time)
+            break;
+        bytes -= _slices[drop].changes->data().size();
+    }
+    _slices.erase(_slices.begin(), _slices.begin() + static_cast<std::ptrdiff_t>(drop));
+    _slices.push_back({ timestamp, _dumping, std::make_shared<VCDValueStore>(*_values), std::move(changes) });
+}
+
+// -----------------------------
+void VCDWriter::dump_recorder()
+{
+    if (_closed)
+        throw VCDPhaseException{ "Cannot dump flight recorder after close()" };
+    if (!_recorder_out)
+        return;
+    if (_registering)
+        _finalize_registration();
+    _ofile.replace_sink(std::exchange(_recorder_out, nullptr));
+    _write_header();
+    for (size_t i = 0; i < _slices.size(); ++i)
+    {
+        const RecorderSlice &slice = _slices[i];
+        _ofile.timestamp(slice.begin);
+        if (i == 0 && _has_values())
+        {
+            _dump_values("$dumpvars", *slice.values);
+            if (!slice.dumping)
+                _dump_off(slice.begin);
+        }
+        _ofile.append(slice.changes->data());
+    }
+    _slices.clear();
+}
+
+// -----------------------------
+// The manifest of the closed segments and the current one up to *end*
+void VCDWriter::_write_manifest(TimeStamp end)
+{
+    std::string manifest;
+    for (const auto &line : _segments)
+        manifest += line;
+    manifest += format("%s\t%llu\t%llu\n", segment_name(_filename, _segments.size()).c_str(),
+                       static_cast<unsigned long long>(_segment_begin), static_cast<unsigned long long>(end));
+    VCDFdSink file(_filename + ".manifest");
+    file.write(manifest.data(), manifest.size());
+}
+
+
+// -----------------------------
+bool VCDWriter::_has_values() const
+{
+    return _values->count != 0;
 }
 
 // -----------------------------
 VCDVariable::VCDVariable(std::string name, VariableType type, unsigned size, ScopePtr scope, unsigned next_var_id) :
-    _ident(next_var_id), _type(type), _name(std::move(name)), _size(size), _scope(std::move(scope))
+    _ident(next_var_id), _code(ident_code(next_var_id)), _type(type), _name(std::move(name)), _size(size),
+    _scope(std::move(scope))
 {
 }
 
 // -----------------------------
 std::string VCDVariable::declartion() const
 {
-    return format("$var %s %d %x %s $end", VAR_TYPES[int(_type)].c_str(), _size, _ident, _name.c_str());
+    return format("$var %s %d %s %s $end", VAR_TYPES[int(_type)].c_str(), _size, _code.c_str(), _name.c_str());
 }
 
 // -----------------------------
 //  :Warning: *value* is string where all characters must be one of `VCDValues`.
 //  An empty  *value* is the same as `VCDValues::UNDEF`
-VarValue VCDVectorVariable::change_record(const VarValue &value) const
+void VCDVectorVariable::change_record(std::string_view value, VarValue &val) const
 {
     if (value.size() > _size)
-        throw VCDTypeException{ format("Invalid binary vector value '%s' size '%d'", value.c_str(), _size) };
+        throw VCDTypeException{ format("Invalid binary vector value '%.*s' size '%d'", int(value.size()), value.data(), _size) };
+
+    val.resize(_size + 2);
+    val[0] = 'b';
+    val[_size + 1] = ' ';
+
+    /***
+     * Example: _size = 4, a 4 bit vector
+     * value is 'xx', it needs to be aligned to the right
+     * end result should look like 'b00xx '
+     */
+    if (value.empty())
+        std::fill_n(val.begin() + 1, _size, VCDValues::UNDEF);
+    else if (!vector_digits(&val[1], value.data(), value.size(), _size))
+        throw VCDTypeException{ format("Invalid binary vector value '%.*s' size '%d'", int(value.size()), value.data(), _size) };
+}
 
-    static VarValue val; // no thread safe mem-alloc optimization
-    val.reserve(_size + 2);
-    val = ('b' + value + ' ');
+// -----------------------------
+bool VCDVectorVariable::change(VCDValueStore &store, uint64_t value, bool is_signed, VarValue &record) const
+{
+    const bool negative = is_signed && static_cast<int64_t>(value) < 0;
+    if (!fits_bits(value, _size, is_signed))
+        throw VCDTypeException{ format("Invalid integer value '%lld' size '%d'",
+                                       static_cast<long long>(value), _size) };
+    if (!store.update_vector(_slot, _size, value, negative))
+        return false;
+
+    const unsigned nbits = std::min(_size, 64u);
+    record.resize(_size + 2);
+    record[0] = 'b';
+    // sign extension of wide vectors
+    char *out = record.data() + 1;
+    out = std::fill_n(out, _size - nbits, negative ? VCDValues::ONE : VCDValues::ZERO);
+    out = write_binary(out, value, nbits);
+    *out = ' ';
+    return true;
+}
+
+// -----------------------------
+void VCDVectorVariable::record(const VCDValueStore &store, VarValue &record) const
+{
+    const unsigned n = VCDValueStore::words_count(_size);
+    const uint64_t *values = &store.words[_slot], *unknowns = values + n;
 
-    auto val_sz = value.size();
-    for (auto i = 1u; i < (val_sz - 1); ++i)
+    record.resize(_size + 2);
+    record[0] = 'b';
+    for (unsigned i = 0; i < _size; ++i)
     {
-        val[i] = static_cast<char>(tolower(static_cast<unsigned char>(val[i])));
-        switch(val[i])
-        {
-        case VCDValues::ONE:
-        case VCDValues::ZERO:
-        case VCDValues::UNDEF:
-        case VCDValues::HIGHV:
-            break;
-        default:
-            throw VCDTypeException{ format("Invalid binary vector value '%s' size '%d'", val.c_str(), _size) };
-        }
+        const unsigned bit = _size - 1u - i;
+        const uint64_t code = ((values[bit / 64u] >> (bit % 64u)) & 1u)
+                            | (((unknowns[bit / 64u] >> (bit % 64u)) & 1u) << 1);
+        record[i + 1] = VCDValueStore::value(code);
     }
-
-    if (!val_sz)
-        val = ('b' + std::string(_size, VCDValues::UNDEF) + ' ');
-    else if (val_sz < _size) // align
-    {
-        /***
-         * Example: _size = 4, a 4 bit vector
-         * value is 'xx' => val_sz = 2
-         * then val is 'bxx ' when entering here, but this is not yet alligned
-         * end result should look like 'b00xx '
-         * so 'xx' needs to be aligned to the right
-         * 'b|x|x| |'       val
-         * 'b|0|0|x|x| |'   val desired
-         * |0|1|2|3|4|5|    index positions
-         */
-
-        val.resize(_size + 2); // to allow full bit chars + 'b' in beginning and a space ' ' at the end
-        auto k = _size - val_sz;
-        /***
-        * k: amount that original 'value' input in val (here 'xx') need to shifted
-        * or in other words: number of zeros that need to be filled in before 'xx'
-        * k is then size(4) - val_sz (2) = 2,
-        * as seen in example first 'x' need to be moved from pos 1 -> 3, second from 2 -> 4
-        * reverse through the 'xx' string, as otherwise chars might be moved to positions that need to be moved aswell
-        * start at val_sz(2) and go back, ending before hitting the 'b'
-        */
-        for (auto i = val_sz ; i >= 1; --i)
-            val[k + i] = val[i];
-        // set remaining values zero
-        for (auto i = 1u; i <= k; ++i)
-            val[i] = VCDValues::ZERO;
-        // set last char to a space
-        val[_size+1] = ' ';
-    }
-    return val;
+    record[_size + 1] = ' ';
 }
 
 // -----------------------------
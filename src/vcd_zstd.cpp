@@ -0,0 +1,110 @@
+#include <utility>
+#include "vcd_writer.h"
+
+#ifdef VCDWRITER_ZSTD
+#include <zstd.h>
+#endif
+
+
+// -----------------------------
+namespace vcd {
+using namespace utils;
+
+namespace {
+// -----------------------------
+void append_le32(std::string &out, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        out.push_back(static_cast<char>((value >> (8 * i)) & 0xFFu));
+}
+} // namespace
+
+#ifdef VCDWRITER_ZSTD
+// -----------------------------
+struct VCDZstdSink::Context
+{
+    ZSTD_CCtx *cctx{};
+
+    ~Context()
+    { ZSTD_freeCCtx(cctx); }
+};
+#else
+struct VCDZstdSink::Context {};
+#endif
+
+// -----------------------------
+VCDZstdSink::VCDZstdSink(SinkPtr out, int level, size_t block, unsigned threads) :
+    VCDCompressSink(std::move(out), block, threads),
+    _contexts(new Context[VCDCompressSink::threads()]),
+    _level(level)
+{
+#ifdef VCDWRITER_ZSTD
+    if (_level < ZSTD_minCLevel() || _level > ZSTD_maxCLevel())
+        throw VCDException{ format("Invalid compression level '%d'", _level) };
+    // the sizes of the seek table entries are 32-bit
+    if (block > (size_t(1u) << 30u))
+        throw VCDException{ format("Invalid frame size '%zu', 1 GiB at most", block) };
+#else
+    throw VCDException{ "Zstandard output is not supported, the library is built without zstd" };
+#endif
+}
+
+// -----------------------------
+VCDZstdSink::VCDZstdSink(const std::string &filename, int level, size_t block, unsigned threads) :
+    VCDZstdSink(std::make_shared<VCDFdSink>(filename), level, block, threads)
+{}
+
+// -----------------------------
+VCDZstdSink::~VCDZstdSink()
+{
+    try
+    { close(); }
+    catch (const VCDException&)
+    {} // nothing to do in destructor
+}
+
+// -----------------------------
+// One frame of the block, the context of the worker is reused
+void VCDZstdSink::compress(unsigned worker, const char *data, size_t size, std::string &out)
+{
+#ifdef VCDWRITER_ZSTD
+    Context &context = _contexts[worker];
+    if (!context.cctx && !(context.cctx = ZSTD_createCCtx()))
+        throw VCDException{ "Cannot create zstd context" };
+    out.resize(ZSTD_compressBound(size));
+    const size_t res = ZSTD_compressCCtx(context.cctx, out.data(), out.size(), data, size, _level);
+    if (ZSTD_isError(res))
+        throw VCDException{ format("Cannot compress block: %s", ZSTD_getErrorName(res)) };
+    out.resize(res);
+#else
+    (void)worker; (void)data; (void)size; (void)out;
+#endif
+}
+
+// -----------------------------
+void VCDZstdSink::written(size_t size, size_t packed)
+{
+    _frames.emplace_back(static_cast<uint32_t>(packed), static_cast<uint32_t>(size));
+}
+
+// -----------------------------
+// The seek table: a skippable frame of the entries and the footer
+// (the number of frames, the descriptor with no checksums, the seekable magic)
+void VCDZstdSink::finish(std::string &out)
+{
+    const size_t entries = _frames.size() * 8u;
+    out.reserve(8u + entries + 9u);
+    append_le32(out, skippable_magic);
+    append_le32(out, static_cast<uint32_t>(entries + 9u));
+    for (const auto &[packed, size] : _frames)
+    {
+        append_le32(out, packed);
+        append_le32(out, size);
+    }
+    append_le32(out, static_cast<uint32_t>(_frames.size()));
+    out.push_back('\0');
+    append_le32(out, seekable_magic);
+}
+
+// -----------------------------
+}
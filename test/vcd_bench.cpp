@@ -0,0 +1,256 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+#include "vcd_writer.h"
+using namespace vcd;
+
+// -----------------------------
+// Microbenchmarks of the VCD writer hot paths
+
+// -----------------------------
+// Heap allocations are counted to report them per change
+static std::atomic<size_t> allocations{ 0 };
+
+[[gnu::noinline]] void* operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc{};
+}
+[[gnu::noinline]] void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { ::operator delete(p); }
+
+// -----------------------------
+// The former `VCDVectorVariable::change_record()` loop: tolower and switch
+// over `VCDValues` char by char, then right-align the value by shifting
+static VarValue legacy_vector_record(const VarValue &value, unsigned size)
+{
+    static VarValue val;
+    val.reserve(size + 2);
+    val = ('b' + value + ' ');
+
+    auto val_sz = value.size();
+    for (auto i = 1u; i < (val_sz + 1); ++i)
+    {
+        val[i] = static_cast<char>(tolower(static_cast<unsigned char>(val[i])));
+        switch(val[i])
+        {
+        case VCDValues::ONE:
+        case VCDValues::ZERO:
+        case VCDValues::UNDEF:
+        case VCDValues::HIGHV:
+            break;
+        default:
+            throw VCDTypeException{ "Invalid binary vector value" };
+        }
+    }
+    if (val_sz < size)
+    {
+        val.resize(size + 2);
+        auto k = size - val_sz;
+        for (auto i = val_sz; i >= 1; --i)
+            val[k + i] = val[i];
+        for (auto i = 1u; i <= k; ++i)
+            val[i] = VCDValues::ZERO;
+        val[size + 1] = ' ';
+    }
+    return val;
+}
+
+// -----------------------------
+static VarValue kernel_vector_record(const VarValue &value, unsigned size)
+{
+    static VarValue val;
+    val.resize(size + 2);
+    val[0] = 'b';
+    val[size + 1] = ' ';
+    if (!utils::vector_digits(&val[1], value.data(), value.size(), size))
+        throw VCDTypeException{ "Invalid binary vector value" };
+    return val;
+}
+
+// -----------------------------
+template <typename Func>
+static double bench_ns(Func &&func, size_t iterations)
+{
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+        func(i);
+    const auto stop = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(stop - start).count() / double(iterations);
+}
+
+// -----------------------------
+static void bench_vector_digits()
+{
+    std::printf("vector value validation and alignment (%s kernel)\n", utils::vector_digits_isa());
+    std::printf("%8s %16s %16s %10s\n", "width", "legacy MB/s", "kernel MB/s", "speed-up");
+
+    std::mt19937 rng(42);
+    const char digits[] = { '0', '1', 'x', 'z', 'X', 'Z' };
+    for (unsigned width : { 8u, 16u, 64u, 128u, 256u, 512u, 1024u })
+    {
+        // a set of values 3/4 of the width, so that they need alignment
+        std::vector<VarValue> values(64);
+        for (auto &v : values)
+        {
+            v.resize(width - width / 4u);
+            for (auto &c : v)
+                c = digits[rng() % sizeof(digits)];
+        }
+
+        const size_t iterations = (size_t(1) << 26) / width;
+        size_t sink = 0;
+        const double legacy = bench_ns([&](size_t i) { sink += legacy_vector_record(values[i % 64], width).size(); }, iterations);
+        const double kernel = bench_ns([&](size_t i) { sink += kernel_vector_record(values[i % 64], width).size(); }, iterations);
+        std::printf("%8u %16.1f %16.1f %9.2fx%s\n", width, width / legacy * 1e3, width / kernel * 1e3,
+                    legacy / kernel, sink ? "" : " ");
+    }
+}
+
+// -----------------------------
+static void bench_real_changes()
+{
+    std::printf("\nreal variable changes\n");
+    std::printf("%16s %16s %16s\n", "path", "ns/change", "vs integer");
+
+    const size_t iterations = size_t(1) << 22;
+    double int_ns = 0;
+    for (int path = 0; path < 3; ++path)
+    {
+        HeadPtr header = makeVCDHeader();
+        VCDWriter writer("bench.vcd", header);
+        VarPtr real = writer.register_var("top", "real", VariableType::real);
+        VarPtr vec = writer.register_var("top", "vec", VariableType::wire, 64);
+        const VarHandle h = writer.handle(path ? real : vec);
+        VarValue text;
+        const double ns = bench_ns([&](size_t i) {
+            const double v = std::sin(double(i) * 1e-3);
+            switch (path)
+            {
+            case 0: writer.change(h, i, i); break;
+            case 1: text = std::to_string(v); writer.change(h, i, text); break;
+            default: writer.change(h, i, v); break;
+            }
+        }, iterations);
+        if (!path)
+            int_ns = ns;
+        const char *names[] = { "integer", "real string", "real double" };
+        std::printf("%16s %16.1f %15.2fx\n", names[path], ns, ns / int_ns);
+    }
+    std::remove("bench.vcd");
+}
+
+// -----------------------------
+static void bench_change_allocations()
+{
+    std::printf("\nchange() of warm writer\n");
+    std::printf("%16s %16s %16s\n", "variable", "ns/change", "allocs/change");
+
+    const size_t iterations = size_t(1) << 22;
+    const char *names[] = { "scalar", "vector int", "vector string", "real double", "string" };
+    for (int kind = 0; kind < 5; ++kind)
+    {
+        HeadPtr header = makeVCDHeader();
+        VCDWriter writer("bench.vcd", header);
+        const VarHandle h = kind == 0 ? writer.register_handle("top", "v", VariableType::wire, 1)
+                          : kind < 3  ? writer.register_handle("top", "v", VariableType::wire, 256)
+                          : kind == 3 ? writer.register_handle("top", "v", VariableType::real)
+                                      : writer.register_handle("top", "v", VariableType::string);
+        const std::string bits(256, '1');
+        const std::string_view states[] = { "IDLE", "FETCH", "DECODE", "EXECUTE" };
+        auto change = [&](size_t i) {
+            switch (kind)
+            {
+            case 0: writer.change(h, i, i & 1u); break;
+            case 1: writer.change(h, i, i); break;
+            case 2: writer.change(h, i, std::string_view(bits).substr(i % 200)); break;
+            case 3: writer.change(h, i, double(i) * 0.25); break;
+            default: writer.change(h, i, states[i % 4]); break;
+            }
+        };
+        for (size_t i = 0; i < 16; ++i)
+            change(i);
+
+        const size_t before = allocations.load();
+        const double ns = bench_ns([&](size_t i) { change(i + 16); }, iterations);
+        std::printf("%16s %16.1f %16.3f\n", names[kind], ns, double(allocations.load() - before) / double(iterations));
+    }
+    std::remove("bench.vcd");
+}
+
+// -----------------------------
+static void bench_sinks()
+{
+    std::printf("\noutput of 64 x 32-bit vectors\n");
+    std::printf("%16s %16s %16s\n", "sink", "ns/change", "MB/s");
+
+    const size_t iterations = size_t(1) << 23;
+    const char *names[] = { "file", "file async", "mmap", "memory", "io_uring", "direct" };
+    for (int kind = 0; kind < 6; ++kind)
+    {
+        HeadPtr header = makeVCDHeader();
+        SinkPtr sink = kind == 2 ? SinkPtr(std::make_shared<VCDMmapSink>("bench.vcd"))
+                     : kind == 3 ? SinkPtr(std::make_shared<VCDMemorySink>())
+                     : kind == 4 ? SinkPtr(std::make_shared<VCDUringSink>("bench.vcd"))
+                     : kind == 5 ? SinkPtr(std::make_shared<VCDDirectSink>("bench.vcd"))
+                                 : SinkPtr(std::make_shared<VCDFdSink>("bench.vcd"));
+        VCDWriter writer(sink, header);
+        writer.set_async(kind == 1);
+        std::vector<VarHandle> vars;
+        for (int i = 0; i < 64; ++i)
+            vars.push_back(writer.register_handle("top", "v" + std::to_string(i), VariableType::wire, 32));
+
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i)
+            writer.change(vars[i % 64], i / 64, (i * 2654435761u) & 0xFFFFFFFFu);
+        writer.close();
+        const double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        std::printf("%16s %16.1f %16.1f\n", names[kind], ns / double(iterations),
+                    double(writer.output_stats().bytes) / ns * 1e3);
+    }
+    std::remove("bench.vcd");
+}
+
+// -----------------------------
+static void bench_scopes()
+{
+    std::printf("\nregistration and header of a var per scope\n");
+    std::printf("%16s %16s %16s\n", "scopes", "register ms", "header ms");
+
+    for (unsigned count : { 2000u, 20000u, 200000u })
+    {
+        HeadPtr header = makeVCDHeader();
+        VCDWriter writer("bench.vcd", header);
+        const auto start = std::chrono::steady_clock::now();
+        // 4 levels of hierarchy, e.g. `top.c3.u17.r5`
+        for (unsigned i = 0; i < count; ++i)
+            writer.register_var(utils::format("top.c%u.u%u.r%u", i % 16u, (i / 16u) % 64u, i / 1024u), "v",
+                                VariableType::wire, 1, "0", false);
+        const auto registered = std::chrono::steady_clock::now();
+        writer.flush();
+        const auto written = std::chrono::steady_clock::now();
+        std::printf("%16u %16.1f %16.1f\n", count,
+                    std::chrono::duration<double, std::milli>(registered - start).count(),
+                    std::chrono::duration<double, std::milli>(written - registered).count());
+    }
+    std::remove("bench.vcd");
+}
+
+// -----------------------------
+int main()
+{
+    bench_vector_digits();
+    bench_real_changes();
+    bench_change_allocations();
+    bench_sinks();
+    bench_scopes();
+    return 0;
+}
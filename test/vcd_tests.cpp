@@ -1,15 +1,44 @@
+#include <atomic>
+#include <cstdlib>
 #include <fstream>
+#include <sstream>
+#include <new>
+#include <thread>
 #include <vcd_writer.h>
 #include <gtest/gtest.h>
+#ifdef VCDWRITER_ZLIB
+#include <zlib.h>
+#endif
+#ifdef VCDWRITER_ZSTD
+#include <zstd.h>
+#endif
 
 using namespace vcd;
 
 // -----------------------------
 
+// Heap allocations are counted while the flag is set (not inlined, so
+// that GCC does not pair `new` expressions with `free()` in the warnings)
+static std::atomic<bool> count_allocations{ false };
+static std::atomic<size_t> allocations{ 0 };
+
+[[gnu::noinline]] void* operator new(std::size_t size)
+{
+    if (count_allocations.load(std::memory_order_relaxed))
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc{};
+}
+[[gnu::noinline]] void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { ::operator delete(p); }
+
+// -----------------------------
+
 // Read the contents to the output file
-static std::string read_file()
+static std::string read_file(const std::string &filename = "test.vcd")
 {
-    std::ifstream file("test.vcd");
+    std::ifstream file(filename);
     EXPECT_TRUE(file.is_open());
     std::string contents((std::istreambuf_iterator<char>(file)),
                          std::istreambuf_iterator<char>());
@@ -204,15 +233,15 @@ TEST_F(VCDWriterFixture, DumpValues)
     EXPECT_EQ(contents, "$timescale 1 ns $end\n"
         "$date 2024-05-21 22:16:16 $end\n"
         "$scope module my_scope $end\n"
-        "$var wire 1 0 my_var $end\n"
+        "$var wire 1 ! my_var $end\n"
         "$upscope $end\n"
         "$enddefinitions $end\n"
         "#0\n"
         "$dumpvars\n"
-        "bx 0\n"
+        "bx !\n"
         "$end\n"
         "#10\n"
-        "b1 0\n");
+        "b1 !\n");
 }
 
 TEST_F(VCDWriterFixture, FlushClose)
@@ -239,15 +268,15 @@ TEST_F(VCDWriterFixture, FlushClose)
     EXPECT_EQ(contents, "$timescale 1 ns $end\n"
         "$date 2024-05-21 22:16:16 $end\n"
         "$scope module my_scope $end\n"
-        "$var wire 1 0 my_var $end\n"
+        "$var wire 1 ! my_var $end\n"
         "$upscope $end\n"
         "$enddefinitions $end\n"
         "#0\n"
         "$dumpvars\n"
-        "bx 0\n"
+        "bx !\n"
         "$end\n"
         "#10\n"
-        "b1 0\n");
+        "b1 !\n");
 }
 
 TEST_F(VCDWriterFixture, SetScopeType)
@@ -268,12 +297,12 @@ TEST_F(VCDWriterFixture, SetScopeType)
     EXPECT_EQ(contents, "$timescale 1 ns $end\n"
         "$date 2024-05-21 22:16:16 $end\n"
         "$scope function my_scope $end\n"
-        "$var wire 1 0 my_var $end\n"
+        "$var wire 1 ! my_var $end\n"
         "$upscope $end\n"
         "$enddefinitions $end\n"
         "#0\n"
         "$dumpvars\n"
-        "bx 0\n"
+        "bx !\n"
         "$end\n");
 }
 
@@ -293,15 +322,82 @@ TEST_F(VCDWriterFixture, SetScopeDefaultType)
     EXPECT_EQ(contents, "$timescale 1 ns $end\n"
         "$date 2024-05-21 22:16:16 $end\n"
         "$scope fork my_scope $end\n"
-        "$var wire 1 0 my_var $end\n"
+        "$var wire 1 ! my_var $end\n"
         "$upscope $end\n"
         "$enddefinitions $end\n"
         "#0\n"
         "$dumpvars\n"
-        "bx 0\n"
+        "bx !\n"
         "$end\n");
 }
 
+TEST_F(VCDWriterFixture, ScopeTree)
+{
+    // siblings and nested scopes registered interleaved
+    writer->register_var("top.b.y", "v1", VariableType::wire, 1);
+    writer->register_var("top.a", "v2", VariableType::wire, 1);
+    writer->register_var("top.b", "v3", VariableType::wire, 1);
+    writer->register_var("top", "v4", VariableType::wire, 1);
+    writer->register_var("top.b.x", "v5", VariableType::wire, 1);
+    writer->register_var("other", "v6", VariableType::wire, 1);
+    writer->register_var("top.c.d", "v7", VariableType::wire, 1);
+    // an intermediate scope with no vars of its own
+    std::string intermediate = "top.c";
+    writer->set_scope_type(intermediate, ScopeType::task);
+    std::string missing = "top.c.e";
+    EXPECT_THROW(writer->set_scope_type(missing, ScopeType::task), VCDPhaseException);
+    writer->flush();
+
+    // each scope once, its vars before its subscopes, the subscopes by name
+    const std::string contents = read_file();
+    EXPECT_EQ(contents.substr(0, contents.find("#0\n")), "$timescale 1 ns $end\n"
+        "$date 2024-05-21 22:16:16 $end\n"
+        "$scope module other $end\n"
+        "$var wire 1 & v6 $end\n"
+        "$upscope $end\n"
+        "$scope module top $end\n"
+        "$var wire 1 $ v4 $end\n"
+        "$scope module a $end\n"
+        "$var wire 1 \" v2 $end\n"
+        "$upscope $end\n"
+        "$scope module b $end\n"
+        "$var wire 1 # v3 $end\n"
+        "$scope module x $end\n"
+        "$var wire 1 % v5 $end\n"
+        "$upscope $end\n"
+        "$scope module y $end\n"
+        "$var wire 1 ! v1 $end\n"
+        "$upscope $end\n"
+        "$upscope $end\n"
+        "$scope task c $end\n"
+        "$scope module d $end\n"
+        "$var wire 1 ' v7 $end\n"
+        "$upscope $end\n"
+        "$upscope $end\n"
+        "$upscope $end\n"
+        "$enddefinitions $end\n");
+}
+
+TEST_F(VCDWriterFixture, ScopeEmptyComponents)
+{
+    for (const char *scope : { "top.", ".top", "a..b", ".", "x.y.z." })
+        EXPECT_THROW(writer->register_var(scope, "v", VariableType::wire, 1), VCDTypeException) << scope;
+    writer->set_scope_sep("::");
+    EXPECT_THROW(writer->register_var("a::::b", "v", VariableType::wire, 1), VCDTypeException);
+    writer->register_var("a::b", "v", VariableType::wire, 1);
+    writer->flush();
+
+    // nothing is left of the rejected ones
+    EXPECT_NE(read_file().find("$date 2024-05-21 22:16:16 $end\n"
+                               "$scope module a $end\n"
+                               "$scope module b $end\n"
+                               "$var wire 1 ! v $end\n"
+                               "$upscope $end\n"
+                               "$upscope $end\n"
+                               "$enddefinitions $end\n"),
+              std::string::npos);
+}
+
 TEST_F(VCDWriterFixture, SetScopeSep)
 {
     // Set the scope separator to "/"
@@ -319,13 +415,13 @@ TEST_F(VCDWriterFixture, SetScopeSep)
         "$date 2024-05-21 22:16:16 $end\n"
         "$scope module my_scope $end\n"
         "$scope module top $end\n"
-        "$var wire 1 0 my_var $end\n"
+        "$var wire 1 ! my_var $end\n"
         "$upscope $end\n"
         "$upscope $end\n"
         "$enddefinitions $end\n"
         "#0\n"
         "$dumpvars\n"
-        "bx 0\n"
+        "bx !\n"
         "$end\n");
 }
 
@@ -355,18 +451,18 @@ TEST_F(VCDWriterFixture, DumpOff)
     EXPECT_EQ(contents, "$timescale 1 ns $end\n"
         "$date 2024-05-21 22:16:16 $end\n"
         "$scope module my_scope $end\n"
-        "$var wire 2 0 my_var $end\n"
+        "$var wire 2 ! my_var $end\n"
         "$upscope $end\n"
         "$enddefinitions $end\n"
         "#0\n"
         "$dumpvars\n"
-        "bxx 0\n"
+        "bxx !\n"
         "$end\n"
         "#10\n"
-        "b01 0\n"
+        "b01 !\n"
         "#10\n"
         "$dumpoff\n"
-        "bx 0\n"
+        "bx !\n"
         "$end\n");
 }
 
@@ -407,23 +503,1023 @@ TEST_F(VCDWriterFixture, DumpOn)
     EXPECT_EQ(contents, "$timescale 1 ns $end\n"
         "$date 2024-05-21 22:16:16 $end\n"
         "$scope module my_scope $end\n"
-        "$var wire 3 0 my_var $end\n"
+        "$var wire 3 ! my_var $end\n"
         "$upscope $end\n"
         "$enddefinitions $end\n"
         "#0\n"
         "$dumpvars\n"
-        "bxxx 0\n"
+        "bxxx !\n"
         "$end\n"
         "#10\n"
-        "b000 0\n"
+        "b000 !\n"
         "#10\n"
         "$dumpoff\n"
-        "bx 0\n"
+        "bx !\n"
         "$end\n"
         "#11\n"
         "$dumpon\n"
         "#11\n"
-        "b011 0\n");
+        "b011 !\n");
+}
+
+TEST_F(VCDWriterFixture, ChangeIntegerValue)
+{
+    VarPtr var = writer->register_var("my_scope", "my_int", VariableType::integer, 8);
+    VarPtr wide = writer->register_var("my_scope", "my_wide", VariableType::wire, 70);
+    VarPtr bit = writer->register_var("my_scope", "my_bit", VariableType::integer, 1);
+    VarPtr bit_vec = writer->register_var("my_scope", "my_bit_vec", VariableType::wire, 1);
+
+    EXPECT_TRUE(writer->change(var, 1, 10u));
+    // the same value as a string
+    EXPECT_FALSE(writer->change(var, 1, "00001010"));
+    EXPECT_TRUE(writer->change(var, 2, -1));
+    EXPECT_FALSE(writer->change(var, 3, uint64_t(255)));
+    EXPECT_TRUE(writer->change(var, 3, uint64_t(254)));
+    // does not fit into the size
+    EXPECT_THROW(writer->change(var, 3, 256), VCDTypeException);
+    EXPECT_THROW(writer->change(var, 3, -129), VCDTypeException);
+
+    EXPECT_TRUE(writer->change(wide, 3, int64_t(-2)));
+    EXPECT_TRUE(writer->change(bit, 3, 1));
+    EXPECT_THROW(writer->change(bit, 3, 2), VCDTypeException);
+    // a one-bit scalar and vector take the same values, `-1` is `1`
+    EXPECT_TRUE(writer->change(bit, 4, 0));
+    EXPECT_TRUE(writer->change(bit, 5, -1));
+    EXPECT_TRUE(writer->change(bit_vec, 5, -1));
+    EXPECT_THROW(writer->change(bit, 5, -2), VCDTypeException);
+    EXPECT_THROW(writer->change(bit_vec, 5, -2), VCDTypeException);
+    // a char is a value char, not a number
+    EXPECT_TRUE(writer->change(bit, 6, '0'));
+    EXPECT_TRUE(writer->change(writer->handle(bit_vec), 6, 'x'));
+    EXPECT_TRUE(writer->change(bit, 7, true));
+    writer->flush();
+
+    const std::string contents = read_file();
+    EXPECT_NE(contents.find("#1\nb00001010 !\n#2\nb11111111 !\n#3\nb11111110 !\n"), std::string::npos);
+    EXPECT_NE(contents.find("b" + std::string(69, '1') + "0 \"\n"), std::string::npos);
+    EXPECT_NE(contents.find("\n1#\n"), std::string::npos);
+    EXPECT_NE(contents.find("#4\n0#\n#5\n1#\nb1 $\n#6\n0#\nbx $\n#7\n1#\n"), std::string::npos);
+}
+
+TEST_F(VCDWriterFixture, PreviousValues)
+{
+    VarPtr bit = writer->register_var("my_scope", "my_bit", VariableType::integer, 1, "z");
+    VarPtr wide = writer->register_var("my_scope", "my_wide", VariableType::wire, 70, "1xz");
+    VarPtr real = writer->register_var("my_scope", "my_real", VariableType::real);
+    VarPtr str = writer->register_var("my_scope", "my_str", VariableType::string, 0, "idle");
+    writer->flush();
+
+    // Initial values are dumped in order of registration
+    EXPECT_NE(read_file().find("$dumpvars\nz!\n"
+                               "b" + std::string(67, '0') + "1xz \"\n"
+                               "r0 #\n"
+                               "sidle $\n$end\n"), std::string::npos);
+
+    EXPECT_FALSE(writer->change(bit, 1, "Z"));
+    EXPECT_TRUE(writer->change(bit, 1, "x"));
+    EXPECT_FALSE(writer->change(wide, 1, "001xz"));
+    EXPECT_TRUE(writer->change(wide, 1, "1" + std::string(69, 'x')));
+    EXPECT_FALSE(writer->change(wide, 1, "1" + std::string(69, 'X')));
+    EXPECT_TRUE(writer->change(wide, 1, 3));
+    EXPECT_FALSE(writer->change(wide, 1, "11"));
+    EXPECT_FALSE(writer->change(real, 1, "0.0"));
+    EXPECT_TRUE(writer->change(real, 1, "0.5"));
+    EXPECT_FALSE(writer->change(real, 1, "5e-1"));
+    EXPECT_FALSE(writer->change(str, 1, "idle"));
+    EXPECT_TRUE(writer->change(str, 1, "busy"));
+    writer->dump_off(2);
+    writer->flush();
+
+    EXPECT_NE(read_file().find("#2\n$dumpoff\nx!\nbx \"\nrnan #\nsx $\n$end\n"), std::string::npos);
+}
+
+TEST_F(VCDWriterFixture, ChangeRealValue)
+{
+    VarPtr real = writer->register_var("my_scope", "my_real", VariableType::real);
+    VarPtr vec = writer->register_var("my_scope", "my_vec", VariableType::wire, 8);
+    const VarHandle h = writer->handle(real);
+
+    EXPECT_FALSE(writer->change(h, 1, 0.0));
+    EXPECT_TRUE(writer->change(h, 1, 0.1));
+    EXPECT_TRUE(writer->change(h, 2, 1.0 / 3));
+    // compared bit by bit: -0.0 differs from 0.0, the same NaN does not
+    EXPECT_TRUE(writer->change(real, 3, 0.0));
+    EXPECT_TRUE(writer->change(real, 3, -0.0));
+    EXPECT_TRUE(writer->change(h, 4, std::numeric_limits<double>::quiet_NaN()));
+    EXPECT_FALSE(writer->change(h, 4, std::numeric_limits<double>::quiet_NaN()));
+    EXPECT_TRUE(writer->change(h, 5, 1e300));
+    EXPECT_TRUE(writer->change(h, 6, 0.30000000000000004));
+    EXPECT_FALSE(writer->change(h, 6, "0.30000000000000004"));
+    EXPECT_THROW(writer->change(vec, 6, 0.5), VCDTypeException);
+    writer->flush();
+
+    EXPECT_NE(read_file().find("#1\nr0.1 !\n#2\nr0.3333333333333333 !\n#3\nr0 !\nr-0 !\n"
+                               "#4\nrnan !\n#5\nr1e+300 !\n#6\nr0.30000000000000004 !\n"), std::string::npos);
+}
+
+TEST_F(VCDWriterFixture, ChangeStringView)
+{
+    VarPtr state = writer->register_var("fsm", "state", VariableType::string);
+    VarPtr real = writer->register_var("fsm", "real", VariableType::real);
+    VarPtr vec = writer->register_var("fsm", "vec", VariableType::wire, 4);
+    const VarHandle h = writer->handle(state);
+
+    // views into one buffer, not null-terminated
+    const std::string_view names = "IDLE FETCH DECODE 2.5e3 1x01";
+    EXPECT_TRUE(writer->change(h, 1, names.substr(0, 4)));
+    EXPECT_TRUE(writer->change(h, 2, names.substr(5, 5)));
+    EXPECT_FALSE(writer->change(h, 2, std::string("FETCH")));
+    EXPECT_TRUE(writer->change(h, 3, names.substr(11, 6)));
+    EXPECT_TRUE(writer->change(h, 4, "IDLE"));
+    EXPECT_TRUE(writer->change(real, 4, names.substr(18, 5)));
+    EXPECT_TRUE(writer->change(vec, 4, names.substr(24, 3)));
+    EXPECT_THROW(writer->change(h, 5, names.substr(0, 10)), VCDTypeException);
+    writer->flush();
+
+    EXPECT_NE(read_file().find("#1\nsIDLE !\n#2\nsFETCH !\n#3\nsDECODE !\n#4\nsIDLE !\nr2500 \"\nb01x0 #\n"),
+              std::string::npos);
+}
+
+TEST_F(VCDWriterFixture, EventsAndParameters)
+{
+    VarPtr irq = writer->register_var("top", "irq", VariableType::event);
+    VarPtr width = writer->register_var("top", "WIDTH", VariableType::parameter, 8, "101");
+    VarPtr bit = writer->register_var("top", "bit", VariableType::wire, 1, "0");
+    const VarHandle h = writer->handle(irq);
+
+    writer->trigger(h, 0);
+    EXPECT_TRUE(writer->change(bit, 1, "1"));
+    writer->trigger(irq, 1);
+    writer->trigger(h, 1);
+    writer->trigger(h, 3);
+    EXPECT_THROW(writer->change(irq, 4, "1"), VCDTypeException);
+    EXPECT_THROW(writer->change(width, 4, 6), VCDTypeException);
+    EXPECT_THROW(writer->trigger(bit, 4), VCDTypeException);
+    EXPECT_THROW(writer->trigger(h, 2), VCDPhaseException);
+    writer->flush();
+
+    // events are not in `$dumpvars`, parameters are written there once
+    EXPECT_NE(read_file().find("#0\n$dumpvars\nb00000101 \"\nb0 #\n$end\n1!\n#1\nb1 #\n1!\n1!\n#3\n1!\n"),
+              std::string::npos);
+}
+
+TEST_F(VCDWriterFixture, EventsOnly)
+{
+    // no `$dumpvars`: `#timestamp` comes before the first trigger, also in coalescing mode
+    VarPtr irq = writer->register_var("top", "irq", VariableType::event);
+    writer->flush();
+    writer->trigger(irq, 0);
+    writer->trigger(irq, 0);
+    writer->set_coalesce(true);
+    writer->trigger(irq, 2);
+    writer->flush();
+
+    const std::string contents = read_file();
+    EXPECT_EQ(contents.substr(contents.find("$enddefinitions")), "$enddefinitions $end\n#0\n1!\n1!\n#2\n1!\n");
+}
+
+TEST_F(VCDWriterFixture, DumpScope)
+{
+    VarPtr a = writer->register_var("top", "a", VariableType::wire, 4, "0");
+    VarPtr b = writer->register_var("top.cpu0", "b", VariableType::wire, 4, "0");
+    VarPtr c = writer->register_var("top.cpu0.sub", "c", VariableType::wire, 4, "0");
+    VarPtr d = writer->register_var("top.cpu01", "d", VariableType::wire, 4, "0");
+    // before the header, `x` in `$dumpvars`
+    writer->dump_scope("top.cpu0.sub", false);
+    for (TimeStamp t = 1; t < 5; ++t)
+    {
+        if (t == 2)
+            writer->dump_scope("top.cpu0", false, &t);
+        if (t == 4)
+            writer->dump_scope("top.cpu0", true, &t);
+        for (const VarPtr &var : { a, b, c, d })
+            writer->change(var, t, t);
+    }
+    EXPECT_THROW(writer->dump_scope("top.cpu", false), VCDPhaseException);
+    const TimeStamp past = 3;
+    EXPECT_THROW(writer->dump_scope("top", false, &past), VCDPhaseException);
+    writer->flush();
+
+    // the disabled vars are `x` once, the enabled ones are dumped with the current values
+    EXPECT_NE(read_file().find("#0\n$dumpvars\nb0000 !\nb0000 \"\nbx #\nb0000 $\n$end\n"
+                               "#1\nb0001 !\nb0001 \"\nb0001 $\n"
+                               "#2\nbx \"\nb0010 !\nb0010 $\n"
+                               "#3\nb0011 !\nb0011 $\n"
+                               "#4\nb0011 \"\nb0011 #\nb0100 !\nb0100 \"\nb0100 #\nb0100 $\n"),
+              std::string::npos);
+}
+
+TEST_F(VCDWriterFixture, DumpScopeCoalesce)
+{
+    writer->set_coalesce(true);
+    VarPtr a = writer->register_var("top", "a", VariableType::wire, 4, "0");
+    VarPtr b = writer->register_var("top.cpu0", "b", VariableType::wire, 4, "0");
+    for (TimeStamp t = 1; t < 6; ++t)
+    {
+        writer->change(a, t, t);
+        writer->change(b, t, t);
+        // the pending change of the step is taken over by the capture record
+        if (t == 1 || t == 5)
+            writer->dump_scope("top.cpu0", false, &t);
+        if (t == 3 || t == 5)
+            writer->dump_scope("top.cpu0", true, &t);
+        if (t == 3)
+            writer->change(b, t, 6);
+    }
+    writer->flush();
+
+    const std::string contents = read_file();
+    EXPECT_EQ(contents.substr(contents.find("$end\n#1\n")),
+              "$end\n#1\nbx \"\nb0001 !\n#2\nb0010 !\n#3\nb0011 \"\nb0011 !\nb0110 \"\n"
+              "#4\nb0100 !\nb0100 \"\n#5\nbx \"\nb0101 \"\nb0101 !\n");
+}
+
+TEST_F(VCDWriterFixture, DumpScopeIntermediate)
+{
+    VarPtr a = writer->register_var("top", "a", VariableType::wire, 4, "0");
+    VarPtr b = writer->register_var("top.core.alu", "b", VariableType::wire, 4, "0");
+    VarPtr c = writer->register_var("top.core.lsu.q", "c", VariableType::wire, 4, "0");
+    // `top.core` has no vars, its subscopes are reached
+    writer->dump_scope("top.core", false);
+    for (const VarPtr &var : { a, b, c })
+        writer->change(var, 1, 1);
+    writer->dump_scope("top.core.lsu", true);
+    writer->flush();
+
+    EXPECT_NE(read_file().find("#0\n$dumpvars\nb0000 !\nbx \"\nbx #\n$end\n#1\nb0001 !\nb0001 #\n"),
+              std::string::npos);
+}
+
+TEST_F(VCDWriterFixture, DumpScopeRealString)
+{
+    VarPtr bit = writer->register_var("top", "bit", VariableType::integer, 1, "0");
+    VarPtr real = writer->register_var("top", "real", VariableType::real);
+    VarPtr str = writer->register_var("top", "str", VariableType::string, 0, "idle");
+    writer->dump_scope("top", false);
+    writer->change(real, 1, 0.5);
+    writer->change(str, 1, "busy");
+    writer->dump_scope("top", true);
+    writer->dump_scope("top", false, nullptr);
+    writer->flush();
+
+    // no stale values: real vars are `rnan`, string ones `sx`
+    EXPECT_NE(read_file().find("#0\n$dumpvars\nx!\nrnan \"\nsx #\n$end\n"
+                               "#1\n0!\nr0.5 \"\nsbusy #\nx!\nrnan \"\nsx #\n"),
+              std::string::npos);
+}
+
+TEST_F(VCDWriterFixture, Coalesce)
+{
+    writer->set_coalesce(true);
+    VarPtr a = writer->register_var("top", "a", VariableType::integer, 1, "0");
+    VarPtr v = writer->register_var("top", "v", VariableType::wire, 8, "0");
+    VarPtr r = writer->register_var("top", "r", VariableType::real);
+    VarPtr s = writer->register_var("top", "s", VariableType::string, 0, "IDLE");
+    VarPtr e = writer->register_var("top", "e", VariableType::event);
+
+    // delta cycles: a glitches back, v and s take their last values
+    EXPECT_TRUE(writer->change(a, 1, 1));
+    EXPECT_TRUE(writer->change(a, 1, 0));
+    EXPECT_TRUE(writer->change(v, 1, 3));
+    EXPECT_TRUE(writer->change(v, 1, 5));
+    EXPECT_TRUE(writer->change(r, 1, 0.5));
+    EXPECT_TRUE(writer->change(s, 1, "FETCH"));
+    EXPECT_TRUE(writer->change(s, 1, "IDLE"));
+    // nothing changes at the end of the timestamp, it is not dumped
+    EXPECT_TRUE(writer->change(v, 2, 6));
+    EXPECT_TRUE(writer->change(v, 2, 5));
+    writer->trigger(e, 3);
+    EXPECT_TRUE(writer->change(a, 3, 1));
+    writer->flush();
+    EXPECT_NE(read_file().find("$end\n#1\nb00000101 \"\nr0.5 #\n#3\n1%\n1!\n"), std::string::npos);
+    EXPECT_EQ(read_file().find("#2"), std::string::npos);
+
+    // dumped at once after the timestamp advances
+    EXPECT_TRUE(writer->change(a, 4, 0));
+    writer->set_coalesce(false);
+    EXPECT_TRUE(writer->change(v, 4, 7));
+    EXPECT_TRUE(writer->change(v, 4, 5));
+    writer->flush();
+    EXPECT_NE(read_file().find("#3\n1%\n1!\n#4\n0!\nb00000111 \"\nb00000101 \"\n"), std::string::npos);
+}
+
+TEST_F(VCDWriterFixture, ChangeByHandle)
+{
+    static_assert(std::is_trivially_copyable_v<VarHandle>);
+
+    VarHandle h = writer->register_handle("my_scope", "my_int", VariableType::integer, 8);
+    VarPtr var = writer->register_var("my_scope", "my_wire", VariableType::wire, 2);
+    EXPECT_EQ(writer->handle(writer->var("my_scope", "my_int")).ident, h.ident);
+
+    EXPECT_TRUE(writer->change(h, 1, 5));
+    EXPECT_FALSE(writer->change(h, 1, "101"));
+    EXPECT_TRUE(writer->change(writer->handle(var), 1, "1z"));
+    EXPECT_THROW(writer->change(VarHandle{ 2 }, 1, 0), VCDTypeException);
+    writer->flush();
+
+    EXPECT_NE(read_file().find("#1\nb00000101 !\nb1z \"\n"), std::string::npos);
+}
+
+TEST_F(VCDWriterFixture, ChangeVectorValidation)
+{
+    VarPtr var = writer->register_var("my_scope", "my_vector", VariableType::wire, 1000);
+
+    std::string value(997, '0');
+    for (size_t i = 0; i < value.size(); ++i)
+        value[i] = "01xzXZ"[i % 6];
+    EXPECT_TRUE(writer->change(var, 1, value));
+    // invalid chars at any position of the value
+    for (size_t i : { size_t(0), size_t(100), size_t(995), size_t(996) })
+    {
+        std::string invalid = value;
+        invalid[i] = 'y';
+        EXPECT_THROW(writer->change(var, 1, invalid), VCDTypeException);
+    }
+    EXPECT_THROW(writer->change(var, 1, std::string(1001, '0')), VCDTypeException);
+    writer->flush();
+
+    std::string expected = "b000" + value + " !\n";
+    for (auto &c : expected)
+        c = char(c == 'X' ? 'x' : c == 'Z' ? 'z' : c);
+    EXPECT_NE(read_file().find("#1\n" + expected), std::string::npos);
+}
+
+TEST_F(VCDWriterFixture, IdentCodes)
+{
+    for (int i = 0; i < 95; ++i)
+        writer->register_var("my_scope", "v" + std::to_string(i), VariableType::wire, 1);
+    writer->flush();
+
+    // base-94 codes of printable ASCII chars
+    const std::string contents = read_file();
+    EXPECT_NE(contents.find("$var wire 1 ! v0 $end\n"), std::string::npos);
+    EXPECT_NE(contents.find("$var wire 1 ~ v93 $end\n"), std::string::npos);
+    EXPECT_NE(contents.find("$var wire 1 !\" v94 $end\n"), std::string::npos);
+    EXPECT_NE(contents.find("bx !\"\n"), std::string::npos);
+}
+
+TEST(VCDOutputTest, BufferSize)
+{
+    // the same dump through the default and the smallest buffers
+    for (size_t buffer_size : { VCDOutput::def_buffer_size, size_t(0) })
+    {
+        HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+        VCDWriter writer(buffer_size ? "test.vcd" : "test_small.vcd", header);
+        writer.set_buffer_size(buffer_size);
+        VarPtr vec = writer.register_var("top", "vec", VariableType::wire, 1000);
+        VarPtr str = writer.register_var("top", "str", VariableType::string);
+        for (TimeStamp t = 1; t < 100; ++t)
+        {
+            writer.change(vec, t, std::string(t * 10, t % 2 ? '1' : 'z'));
+            // longer than the whole buffer
+            writer.change(str, t, std::string(t * 100, char('a' + t % 26)));
+        }
+        writer.close();
+    }
+    const std::string contents = read_file();
+    EXPECT_EQ(contents, read_file("test_small.vcd"));
+    EXPECT_NE(contents.find("#99\nb" + std::string(10, '0') + std::string(990, '1')), std::string::npos);
+}
+
+TEST(VCDOutputTest, Timestamps)
+{
+    HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+    {
+        VCDWriter writer("test.vcd", header);
+        VarPtr var = writer.register_var("top", "var", VariableType::wire, 1);
+        for (TimeStamp t : { 9u, 10u, 99u, 100u, 12345u, 4294967295u })
+            writer.change(var, t, t % 2 ? "1" : "0");
+    }
+    EXPECT_NE(read_file().find("#9\nb1 !\n#10\nb0 !\n#99\nb1 !\n#100\nb0 !\n#12345\nb1 !\n#4294967295\n"),
+              std::string::npos);
+}
+
+TEST(VCDWriterTest, NoAllocations)
+{
+    const char *modes[] = { "sync", "async", "coalesce" };
+    for (int mode = 0; mode < 3; ++mode)
+    {
+        HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+        VCDWriter writer("test.vcd", header);
+        writer.set_buffer_size(0);
+        writer.set_async(mode == 1);
+        writer.set_coalesce(mode == 2);
+        const VarHandle bit = writer.register_handle("top", "bit", VariableType::wire, 1);
+        const VarHandle vec = writer.register_handle("top", "vec", VariableType::wire, 200);
+        const VarHandle real = writer.register_handle("top", "real", VariableType::real);
+        const VarHandle str = writer.register_handle("top", "str", VariableType::string);
+        const VarHandle irq = writer.register_handle("top", "irq", VariableType::event);
+        const VarHandle scalar = writer.handle(writer.register_var("top", "scalar", VariableType::integer, 1));
+        const std::string_view states[] = { "IDLE", "FETCH", "DECODE", "EXECUTE_LONG_STATE" };
+        const std::string vec_value(150, 'z');
+        // unsorted: applied in handle order with no allocation either
+        std::vector<VarChange> batch = { { scalar, 0 }, { vec, 0 }, { bit, 0 } };
+
+        auto step = [&](TimeStamp t) {
+            writer.change(bit, t, t % 2 ? "1" : "0");
+            writer.change(scalar, t, t % 3 ? 1u : 0u);
+            writer.change(vec, t, t * 0x9E3779B97F4A7C15ull);
+            writer.change(vec, t, std::string_view(vec_value).substr(t % 100));
+            writer.change(real, t, double(t) / 7);
+            writer.change(real, t, t % 2 ? "0.125" : "-1e-300");
+            writer.change(str, t, states[t % 4]);
+            writer.trigger(irq, t);
+            batch[0].value = t / 4 % 2;
+            batch[1].value = t;
+            batch[2].value = t / 2 % 2;
+            writer.change_batch(t + 1, batch);
+        };
+        // warm up: the header, the buffers and the longest values
+        for (TimeStamp t = 0; t < 8; t += 2)
+            step(t);
+        writer.flush();
+
+        allocations = 0;
+        count_allocations = true;
+        for (TimeStamp t = 8; t < 20000; t += 2)
+            step(t);
+        writer.flush();
+        count_allocations = false;
+        EXPECT_EQ(allocations.load(), 0u) << modes[mode];
+        EXPECT_GT(writer.output_stats().writes, 10u);
+    }
+}
+
+// -----------------------------
+
+// The header of the reference dumps, its date is fixed to compare them
+static HeadPtr reference_header()
+{
+    return makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+}
+
+// The reference dump through *writer*: a 64-bit vector and a short string at each
+// timestamp, every 100th string is longer than the smallest buffer, a flush halfway.
+// *step* is called before the changes of each timestamp
+static void write_reference(VCDWriter &writer, const std::function<void(TimeStamp)> &step = nullptr)
+{
+    VarPtr vec = writer.register_var("top", "vec", VariableType::wire, 64);
+    VarPtr str = writer.register_var("top", "str", VariableType::string);
+    for (TimeStamp t = 1; t < 3000; ++t)
+    {
+        if (step)
+            step(t);
+        writer.change(vec, t, t * 0x9E3779B97F4A7C15ull);
+        writer.change(str, t, std::string(t % 100 ? t % 50 + 1 : t * 5, char('a' + t % 26)));
+        if (t == 1500)
+            writer.flush();
+    }
+    writer.close();
+}
+
+// The reference dump into `test.vcd` by `write(2)`, return its contents
+static std::string write_reference_file()
+{
+    HeadPtr header = reference_header();
+    VCDWriter writer("test.vcd", header);
+    write_reference(writer);
+    return read_file();
+}
+
+TEST(VCDOutputTest, Sinks)
+{
+    const std::string contents = write_reference_file();
+
+    // in-memory
+    auto memory = std::make_shared<VCDMemorySink>();
+    HeadPtr header = reference_header();
+    VCDWriter mem_writer(memory, header);
+    write_reference(mem_writer);
+    EXPECT_EQ(memory->data(), contents);
+
+    // callback, by chunks of the buffer size through the async thread
+    std::string chunks;
+    size_t count = 0;
+    bool closed = false;
+    header = reference_header();
+    VCDWriter cb_writer(std::make_shared<VCDCallbackSink>([&](const char *data, size_t size) {
+                            chunks.append(data, size);
+                            ++count;
+                        }, [&] { closed = true; }), header);
+    cb_writer.set_buffer_size(0);
+    cb_writer.set_async(true);
+    write_reference(cb_writer);
+    EXPECT_EQ(chunks, contents);
+    // the strings longer than the buffer take a chunk of their own
+    EXPECT_GT(count, contents.size() / (2 * VCDOutput::min_buffer_size));
+    EXPECT_TRUE(closed);
+
+    // C stream, it is left open
+    std::FILE *stream = std::fopen("test_stream.vcd", "wb");
+    ASSERT_NE(stream, nullptr);
+    header = reference_header();
+    VCDWriter stream_writer(std::make_shared<VCDStreamSink>(stream), header);
+    write_reference(stream_writer);
+    EXPECT_EQ(std::fclose(stream), 0);
+    EXPECT_EQ(read_file("test_stream.vcd"), contents);
+
+    // errors of the sink come out of the writer's calls
+    header = makeVCDHeader();
+    VCDWriter bad_writer(std::make_shared<VCDCallbackSink>([](const char*, size_t) {
+                             throw VCDException{ "Sink is full" };
+                         }), header);
+    bad_writer.register_var("top", "bit", VariableType::wire, 1);
+    EXPECT_THROW(bad_writer.flush(), VCDException);
+    EXPECT_THROW(VCDWriter(SinkPtr{}, header), VCDException);
+}
+
+TEST(VCDOutputTest, MmapSink)
+{
+    // the smallest extents, through the async thread
+    const std::string contents = write_reference_file();
+    HeadPtr header = reference_header();
+    VCDWriter writer(std::make_shared<VCDMmapSink>("test_mmap.vcd", 0), header);
+    writer.set_buffer_size(0);
+    writer.set_async(true);
+    write_reference(writer);
+    EXPECT_EQ(read_file("test_mmap.vcd"), contents);
+}
+
+TEST(VCDOutputTest, DirectSink)
+{
+    EXPECT_THROW(VCDDirectSink("test_direct.vcd", 1000), VCDException);
+    // the file system may refuse O_DIRECT, the sink falls back to the page cache then
+    auto sink = std::make_shared<VCDDirectSink>("test_direct.vcd", 512);
+    if (!sink->direct())
+        GTEST_SKIP() << "O_DIRECT is not supported here";
+
+    // the unaligned records and the flush in the middle, the tail is written on close
+    const std::string contents = write_reference_file();
+    HeadPtr header = reference_header();
+    VCDWriter writer(sink, header);
+    writer.set_buffer_size(0);
+    write_reference(writer);
+    EXPECT_TRUE(sink->direct());
+    EXPECT_EQ(read_file("test_direct.vcd"), contents);
+}
+
+#ifdef VCDWRITER_ZLIB
+// Inflate the concatenated gzip members, count them
+static std::string gunzip(const std::string &data, size_t &members)
+{
+    members = 0;
+    std::string out;
+    z_stream z{};
+    EXPECT_EQ(inflateInit2(&z, 16 + MAX_WBITS), Z_OK);
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    z.avail_in = static_cast<uInt>(data.size());
+    char buffer[16384];
+    while (z.avail_in)
+    {
+        z.next_out = reinterpret_cast<Bytef*>(buffer);
+        z.avail_out = sizeof(buffer);
+        const int res = inflate(&z, Z_NO_FLUSH);
+        out.append(buffer, sizeof(buffer) - z.avail_out);
+        if (res == Z_STREAM_END)
+        {
+            ++members;
+            inflateReset(&z);
+        }
+        else if (res != Z_OK)
+        {
+            ADD_FAILURE() << "invalid gzip data";
+            break;
+        }
+    }
+    inflateEnd(&z);
+    return out;
+}
+#endif
+
+TEST(VCDOutputTest, GzipSink)
+{
+#ifdef VCDWRITER_ZLIB
+    // the smallest blocks, so that there are many members in flight
+    const std::string contents = write_reference_file();
+    auto memory = std::make_shared<VCDMemorySink>();
+    HeadPtr header = reference_header();
+    VCDWriter writer(std::make_shared<VCDGzipSink>(memory, 1, 0, 3), header);
+    write_reference(writer);
+    size_t members = 0;
+    EXPECT_EQ(gunzip(memory->data(), members), contents);
+    EXPECT_GE(members, contents.size() / VCDCompressSink::min_block);
+    EXPECT_LT(memory->data().size(), contents.size() / 2);
+
+    EXPECT_THROW(VCDGzipSink(memory, 10), VCDException);
+#else
+    EXPECT_THROW(VCDGzipSink(std::make_shared<VCDMemorySink>()), VCDException);
+#endif
+}
+
+TEST(VCDOutputTest, ZstdSink)
+{
+#ifdef VCDWRITER_ZSTD
+    const std::string contents = write_reference_file();
+    auto memory = std::make_shared<VCDMemorySink>();
+    HeadPtr header = reference_header();
+    VCDWriter writer(std::make_shared<VCDZstdSink>(memory, 1, 0, 3), header);
+    write_reference(writer);
+    const std::string &zst = memory->data();
+
+    // the whole stream, the seek table is skipped
+    std::string out(contents.size(), '\0');
+    EXPECT_EQ(ZSTD_decompress(out.data(), out.size(), zst.data(), zst.size()), contents.size());
+    EXPECT_EQ(out, contents);
+
+    // the seek table and the frames by it
+    auto le32 = [&zst](size_t pos) {
+        uint32_t value = 0;
+        for (int i = 3; i >= 0; --i)
+            value = (value << 8u) | static_cast<unsigned char>(zst[pos + i]);
+        return value;
+    };
+    ASSERT_GT(zst.size(), 17u);
+    EXPECT_EQ(le32(zst.size() - 4), VCDZstdSink::seekable_magic);
+    EXPECT_EQ(zst[zst.size() - 5], '\0');
+    const uint32_t frames = le32(zst.size() - 9);
+    EXPECT_GE(frames, contents.size() / VCDCompressSink::min_block);
+    const size_t table = zst.size() - 9 - frames * 8u;
+    ASSERT_EQ(le32(table - 8), VCDZstdSink::skippable_magic);
+    EXPECT_EQ(le32(table - 4), frames * 8u + 9u);
+    size_t packed = 0, size = 0;
+    for (uint32_t i = 0; i < frames; ++i)
+    {
+        const uint32_t frame_packed = le32(table + i * 8u), frame_size = le32(table + i * 8u + 4u);
+        if (i == frames / 2)
+        {
+            std::string frame(frame_size, '\0');
+            EXPECT_EQ(ZSTD_decompress(frame.data(), frame.size(), zst.data() + packed, frame_packed), frame_size);
+            EXPECT_EQ(frame, contents.substr(size, frame_size));
+        }
+        packed += frame_packed;
+        size += frame_size;
+    }
+    EXPECT_EQ(packed, table - 8);
+    EXPECT_EQ(size, contents.size());
+#else
+    EXPECT_THROW(VCDZstdSink(std::make_shared<VCDMemorySink>()), VCDException);
+#endif
+}
+
+TEST(VCDOutputTest, Segments)
+{
+    auto dump = [](VCDWriter &writer) {
+        VarPtr vec = writer.register_var("top", "vec", VariableType::wire, 16);
+        VarPtr bit = writer.register_var("top.sub", "bit", VariableType::wire, 1);
+        for (TimeStamp t = 1; t < 2000; ++t)
+        {
+            writer.change(vec, t, t);
+            if (t % 7 == 0)
+                writer.change(bit, t, (t / 7) % 2);
+        }
+        writer.close();
+    };
+    HeadPtr header = reference_header();
+    {
+        VCDWriter writer("test.vcd", header);
+        dump(writer);
+    }
+    const std::string contents = read_file();
+    const size_t body = contents.find("$end\n", contents.find("$dumpvars")) + 5;
+
+    for (bool by_time : { false, true })
+    {
+        header = reference_header();
+        VCDWriter writer("test_seg.vcd", header);
+        writer.set_segments(by_time ? 0 : 4000, by_time ? 300 : 0);
+        writer.set_async(by_time);
+        dump(writer);
+
+        // each segment is the header, `#begin` and `$dumpvars` of the values at its start,
+        // the changes after them are the same as without segments
+        std::istringstream manifest(read_file("test_seg.vcd.manifest"));
+        std::string name, changes;
+        TimeStamp begin = 0, end = 0, prev_end = 0;
+        size_t count = 0;
+        while (manifest >> name >> begin >> end)
+        {
+            EXPECT_EQ(name, count ? "test_seg_" + std::to_string(count) + ".vcd" : "test_seg.vcd");
+            EXPECT_LE(begin, end);
+            if (count)
+            {
+                EXPECT_EQ(begin, prev_end + 1);
+            }
+            if (by_time)
+            {
+                EXPECT_LT(end - begin, 300u);
+            }
+            const std::string segment = read_file(name);
+            const std::string start = "#" + std::to_string(begin) + "\n$dumpvars\n";
+            const size_t dumpvars = segment.find(start);
+            ASSERT_NE(dumpvars, std::string::npos);
+            EXPECT_EQ(segment.substr(0, dumpvars), contents.substr(0, contents.find("#0\n")));
+            if (count)
+            {
+                // the vector had the previous timestamp as its value
+                std::string value(16, '0');
+                for (unsigned i = 0; i < 16u; ++i)
+                    value[15u - i] = char('0' + (((begin - 1) >> i) & 1u));
+                EXPECT_NE(segment.find("b" + value + " !\n", dumpvars), std::string::npos);
+                changes += "#" + std::to_string(begin) + "\n";
+            }
+            if (!by_time)
+            {
+                EXPECT_LT(segment.size(), 4000u + 200u);
+            }
+            changes += segment.substr(segment.find("$end\n", dumpvars) + 5);
+            prev_end = end;
+            ++count;
+        }
+        EXPECT_GT(count, 5u);
+        EXPECT_EQ(prev_end, 1999u);
+        EXPECT_EQ(changes, contents.substr(body));
+    }
+
+    // the next segments are written by io_uring too
+    header = reference_header();
+    {
+        VCDWriter writer("test_seg.vcd", header);
+        const bool uring = writer.set_io_uring(true);
+        writer.set_segments(4000);
+        VarPtr vec = writer.register_var("top", "vec", VariableType::wire, 16);
+        for (TimeStamp t = 1; t < 2000; ++t)
+            writer.change(vec, t, t);
+        EXPECT_EQ(writer.io_uring(), uring);
+        writer.close();
+    }
+    std::istringstream manifest(read_file("test_seg.vcd.manifest"));
+    std::string line, last;
+    size_t count = 0;
+    for (; std::getline(manifest, line); ++count)
+        last = line.substr(0, line.find('\t'));
+    EXPECT_GT(count, 5u);
+    EXPECT_NE(read_file(last).find("#1999\nb0000011111001111 !\n"), std::string::npos);
+
+    header = reference_header();
+    EXPECT_THROW(VCDWriter(std::make_shared<VCDMemorySink>(), header).set_segments(1000), VCDException);
+}
+
+TEST(VCDOutputTest, FlightRecorder)
+{
+    auto dump = [](VCDWriter &writer, TimeStamp dump_at) {
+        VarPtr vec = writer.register_var("top", "vec", VariableType::wire, 16);
+        VarPtr bit = writer.register_var("top.sub", "bit", VariableType::wire, 1);
+        for (TimeStamp t = 1; t < 2000; ++t)
+        {
+            if (t == dump_at)
+                writer.dump_recorder();
+            writer.change(vec, t, t);
+            if (t % 7 == 0)
+                writer.change(bit, t, (t / 7) % 2);
+        }
+        writer.close();
+    };
+    HeadPtr header = reference_header();
+    {
+        VCDWriter writer("test.vcd", header);
+        dump(writer, 0);
+    }
+    const std::string contents = read_file();
+    const std::string head = contents.substr(0, contents.find("#0\n"));
+
+    // the window of the last changes (up to the dump), then the changes after it
+    for (int mode = 0; mode < 3; ++mode)
+    {
+        header = reference_header();
+        VCDWriter writer("test_flight.vcd", header);
+        writer.set_flight_recorder(mode == 1 ? 6000 : 0, mode == 1 ? 0 : 400);
+        dump(writer, mode == 2 ? 1000 : 0);
+        const std::string recorded = read_file("test_flight.vcd");
+        ASSERT_EQ(recorded.substr(0, head.size()), head);
+        const size_t dumpvars = recorded.find("$dumpvars\n");
+        ASSERT_NE(dumpvars, std::string::npos);
+        const TimeStamp begin = std::stoull(recorded.substr(head.size() + 1));
+        const TimeStamp end = mode == 2 ? 999 : 1999;
+        if (mode == 1)
+        {
+            EXPECT_LE(recorded.size() - dumpvars, 6000u + 6000u / VCDWriter::recorder_slices + 200u);
+            EXPECT_GE(recorded.size() - dumpvars, 6000u - 6000u / VCDWriter::recorder_slices);
+        }
+        else
+        {
+            EXPECT_LE(begin, end - 400);
+            EXPECT_GE(begin, end - 400 - 400 / VCDWriter::recorder_slices);
+        }
+        // the values at the start and the changes as without the recorder
+        std::string value(16, '0');
+        for (unsigned i = 0; i < 16u; ++i)
+            value[15u - i] = char('0' + (((begin - 1) >> i) & 1u));
+        const size_t changes = recorded.find("$end\n", dumpvars) + 5;
+        EXPECT_NE(recorded.substr(dumpvars, changes - dumpvars).find("b" + value + " !\n"), std::string::npos);
+        EXPECT_EQ(recorded.substr(changes), contents.substr(contents.find("#" + std::to_string(begin) + "\n") +
+                                                            std::to_string(begin).size() + 2));
+    }
+    header = makeVCDHeader();
+    VCDWriter writer("test_flight.vcd", header);
+    EXPECT_THROW(writer.set_flight_recorder(0), VCDException);
+    writer.flush();
+    EXPECT_THROW(writer.set_flight_recorder(1000), VCDPhaseException);
+}
+
+TEST(VCDOutputTest, IoUring)
+{
+    // io_uring turned on and off during the dump, the same output as by `write(2)`
+    const std::string contents = write_reference_file();
+    HeadPtr header = reference_header();
+    VCDWriter writer("test_uring.vcd", header);
+    writer.set_buffer_size(0);
+    write_reference(writer, [&writer](TimeStamp t) {
+        if (t % 1000 == 1)
+            writer.set_io_uring(t != 1001, t == 2001 ? 0u : 8u);
+    });
+    EXPECT_EQ(read_file("test_uring.vcd"), contents);
+
+    // async mode is kept: no thread while io_uring lends the buffers, on again after it
+    header = reference_header();
+    VCDWriter async_writer("test_uring.vcd", header);
+    async_writer.set_async(true);
+    const bool uring = async_writer.set_io_uring(true);
+    EXPECT_EQ(async_writer.io_uring(), uring);
+    EXPECT_EQ(async_writer.async(), !uring);
+    EXPECT_FALSE(async_writer.set_io_uring(false));
+    EXPECT_TRUE(async_writer.async());
+    async_writer.close();
+
+    // only a file descriptor sink, the mode is left as is
+    header = reference_header();
+    VCDWriter mem_writer(std::make_shared<VCDMemorySink>(), header);
+    mem_writer.set_async(true);
+    EXPECT_THROW(mem_writer.set_io_uring(true), VCDException);
+    EXPECT_TRUE(mem_writer.async());
+    EXPECT_FALSE(mem_writer.io_uring());
+
+    // depth `0` is `write(2)`
+    VCDUringSink sink("test_uring.vcd", 0);
+    EXPECT_FALSE(sink.active());
+    sink.write("#1\n", 3);
+    sink.close();
+    EXPECT_EQ(read_file("test_uring.vcd"), "#1\n");
+}
+
+TEST(VCDOutputTest, AsyncMode)
+{
+    // the same dump written synchronously and by the background thread
+    const std::string contents = write_reference_file();
+    for (bool async : { false, true })
+    {
+        const std::string filename = async ? "test_async.vcd" : "test.vcd";
+        HeadPtr header = reference_header();
+        VCDWriter writer(filename, header);
+        writer.set_buffer_size(0);
+        writer.set_async(async);
+        write_reference(writer, [&filename](TimeStamp t) {
+            // flush() is a fence: all the data is in the file
+            if (t == 1501)
+            {
+                EXPECT_NE(read_file(filename).find("#1500\n"), std::string::npos);
+            }
+        });
+
+        const VCDOutputStats stats = writer.output_stats();
+        EXPECT_GT(stats.writes, 1u);
+        EXPECT_GE(stats.max_stall_ns * stats.stalls, stats.stall_ns);
+        if (!async)
+        {
+            EXPECT_EQ(stats.stalls, 0u);
+        }
+        EXPECT_EQ(stats.bytes, read_file(filename).size());
+    }
+    EXPECT_EQ(read_file("test_async.vcd"), contents);
+}
+
+TEST_F(VCDWriterFixture, ChangeBatch)
+{
+    VarHandle a = writer->register_handle("my_scope", "a", VariableType::wire, 4);
+    VarHandle b = writer->register_handle("my_scope", "b", VariableType::integer, 1);
+    VarHandle c = writer->register_handle("my_scope", "c", VariableType::wire, 8);
+
+    std::vector<VarChange> changes{ { c, 0x81 }, { a, 1 }, { b, 1 }, { a, 2 } };
+    EXPECT_EQ(writer->change_batch(5, changes), 4u);
+    // applied by handle, changes of the same var in given order, the batch is left as is
+    EXPECT_EQ(changes[0].var.ident, c.ident);
+    EXPECT_EQ(changes[1].value, 1u);
+    EXPECT_EQ(changes[3].value, 2u);
+
+    changes = { { c, 0x81 }, { a, 2 } };
+    EXPECT_EQ(writer->change_batch(6, changes), 0u);
+    changes = { { b, 0 } };
+    EXPECT_EQ(writer->change_batch(6, changes), 1u);
+    EXPECT_THROW(writer->change_batch(5, changes), VCDPhaseException);
+    writer->flush();
+
+    EXPECT_NE(read_file().find("#5\nb0001 !\nb0010 !\n1\"\nb10000001 #\n#6\n0\"\n"), std::string::npos);
+}
+
+// -----------------------------
+
+// Dump of one shard, its values depend on *shard*
+static void write_shard(unsigned shard)
+{
+    HeadPtr header = reference_header();
+    VCDWriter writer("test_shard" + std::to_string(shard) + ".vcd", header);
+    writer.set_buffer_size(0);
+    VarPtr vec = writer.register_var("top", "vec", VariableType::wire, 100);
+    VarPtr wide = writer.register_var("top", "wide", VariableType::reg, 300);
+    VarPtr num = writer.register_var("top", "num", VariableType::integer, 32);
+    VarPtr str = writer.register_var("top", "str", VariableType::string);
+    for (TimeStamp t = 0; t < 500; ++t)
+    {
+        const unsigned v = t * 7919u + shard;
+        std::string bits(1 + v % 100, '0');
+        for (size_t i = 0; i < bits.size(); ++i)
+            bits[i] = "01xz"[(v >> (i % 16)) % 4];
+        writer.change(vec, t, bits);
+        writer.change(wide, t, std::string(1 + v % 300, "01XZ"[v % 4]));
+        writer.change(num, t, v);
+        writer.change(str, t, "s" + std::to_string(v % 13));
+    }
+}
+
+// Writers on different threads produce the same output as sequential ones
+TEST(VCDWriterThreadsTest, ParallelWriters)
+{
+    const unsigned shards = 32;
+    std::vector<std::string> expected;
+    for (unsigned shard = 0; shard < shards; ++shard)
+    {
+        write_shard(shard);
+        expected.push_back(read_file("test_shard" + std::to_string(shard) + ".vcd"));
+    }
+
+    std::vector<std::thread> threads;
+    for (unsigned shard = 0; shard < shards; ++shard)
+        threads.emplace_back(write_shard, shard);
+    for (auto &thread : threads)
+        thread.join();
+
+    for (unsigned shard = 0; shard < shards; ++shard)
+        EXPECT_EQ(read_file("test_shard" + std::to_string(shard) + ".vcd"), expected[shard]) << "shard " << shard;
+}
+
+// Producers push through channels, the output is the same as of a sequential
+// writer which dumps the changes of a timestamp in order of the channels
+TEST(VCDWriterThreadsTest, ProducerChannels)
+{
+    const unsigned producers = 4, vars = 8, steps = 2000;
+    auto value = [](unsigned p, unsigned v, TimeStamp t) { return uint64_t((t * 31u + v * 7u + p) % 5u); };
+
+    {
+        HeadPtr header = reference_header();
+        VCDWriter writer("test_seq.vcd", header);
+        std::vector<VarHandle> handles;
+        for (unsigned i = 0; i < producers * vars; ++i)
+            handles.push_back(writer.register_handle("top.p" + std::to_string(i / vars), "v" + std::to_string(i % vars),
+                                                     VariableType::wire, 3));
+        for (TimeStamp t = 0; t < steps; ++t)
+            for (unsigned p = 0; p < producers; ++p)
+                for (unsigned v = 0; v < vars; ++v)
+                    if ((t + v) % (p + 2u) == 0)
+                        writer.change(handles[p * vars + v], t, value(p, v, t));
+    }
+    {
+        HeadPtr header = reference_header();
+        VCDWriter writer("test.vcd", header);
+        std::vector<VarHandle> handles;
+        for (unsigned i = 0; i < producers * vars; ++i)
+            handles.push_back(writer.register_handle("top.p" + std::to_string(i / vars), "v" + std::to_string(i % vars),
+                                                     VariableType::wire, 3));
+        std::vector<ChannelPtr> channels;
+        for (unsigned p = 0; p < producers; ++p)
+            channels.push_back(writer.channel(64));
+
+        std::atomic<unsigned> done{};
+        std::vector<std::thread> threads;
+        for (unsigned p = 0; p < producers; ++p)
+            threads.emplace_back([&, p]() {
+                for (TimeStamp t = 0; t < steps; ++t)
+                {
+                    for (unsigned v = 0; v < vars; ++v)
+                        if ((t + v) % (p + 2u) == 0)
+                            channels[p]->push(t, handles[p * vars + v], value(p, v, t));
+                    channels[p]->advance(t + 1);
+                }
+                channels[p]->close();
+                ++done;
+            });
+
+        // the serializer
+        while (done < producers)
+            writer.drain();
+        for (auto &thread : threads)
+            thread.join();
+        writer.close();
+    }
+    EXPECT_EQ(read_file(), read_file("test_seq.vcd"));
+
+    VCDChannel channel;
+    channel.push(5, VarHandle{ 0 }, 1);
+    EXPECT_THROW(channel.push(4, VarHandle{ 0 }, 1), VCDPhaseException);
+    EXPECT_THROW(channel.advance(4), VCDPhaseException);
 }
 
 // -----------------------------